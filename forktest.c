@@ -0,0 +1,132 @@
+/*
+ * forktest.c - Checks that forked processes sharing a heap never get the
+ * same block
+ *
+ * The parent fills its thread cache and then forks. Every process allocates
+ * blocks in each round, all of them check that no two processes got the
+ * same one, and then free them again, so the next round reallocates what
+ * the caches and arenas got back.
+ */
+#define _GNU_SOURCE             /* memfd_create */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+int verbose = 0;  /* mm_checkheap prints nothing more */
+
+void mm_checkheap(int verbose);
+
+#define PROCS     3             /* the parent and its children */
+#define NBLOCKS   64
+#define ROUNDS    8
+
+/* Kept in the heap, where every process sees it */
+typedef struct {
+    unsigned int arrived;                   /* processes at a barrier so far */
+    unsigned int failed;                    /* set when a process found an error */
+    unsigned int offs[PROCS][NBLOCKS];      /* each process's blocks, as offsets from the heap */
+} board_t;
+
+static board_t *board;
+
+/*
+ * fail - Tell the other processes and exit
+ */
+static void fail(int proc, char *msg)
+{
+    printf("ERROR: process %d: %s\n", proc, msg);
+    __atomic_store_n(&board->failed, 1, __ATOMIC_RELEASE);
+    exit(1);
+}
+
+/*
+ * barrier - Wait until all processes have arrived at the n-th barrier
+ */
+static void barrier(int proc, int n)
+{
+    __atomic_add_fetch(&board->arrived, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&board->arrived, __ATOMIC_ACQUIRE) < (unsigned int)(n * PROCS)) {
+	if (__atomic_load_n(&board->failed, __ATOMIC_ACQUIRE))
+	    exit(1);
+	sched_yield();
+    }
+}
+
+/*
+ * run - Allocate, compare with the other processes and free, round by round
+ */
+static void run(int proc)
+{
+    char *base = mem_heap_lo(), *p[NBLOCKS];
+    int round, i, j, k;
+
+    for (round = 0; round < ROUNDS; round++) {
+	for (i = 0; i < NBLOCKS; i++) {
+	    if ((p[i] = mm_malloc(round % 2 ? 24 : 40)) == NULL)
+		fail(proc, "mm_malloc failed");
+	    memset(p[i], proc, 24);
+	    board->offs[proc][i] = p[i] - base;
+	}
+	barrier(proc, 2 * round + 1);
+	for (j = 0; j < PROCS; j++)
+	    if (j != proc)
+		for (i = 0; i < NBLOCKS; i++)
+		    for (k = 0; k < NBLOCKS; k++)
+			if (board->offs[proc][i] == board->offs[j][k])
+			    fail(proc, "another process got the same block");
+	for (i = 0; i < NBLOCKS; i++)
+	    if (p[i][0] != proc || p[i][23] != proc)
+		fail(proc, "another process wrote into a block");
+	barrier(proc, 2 * round + 2);
+	for (i = 0; i < NBLOCKS; i++)
+	    mm_free(p[i]);
+    }
+}
+
+int main(void)
+{
+    char *p[NBLOCKS];
+    int proc, i, status, ok = 1;
+
+#if !MM_SHARED
+    /* only a shared heap is the same heap after a fork */
+    printf("forktest: skipped, needs a build with SHARED=1\n");
+    return 0;
+#endif
+    mem_init_fd(memfd_create("forktest", 0));
+    if (mm_init() < 0) {
+	printf("ERROR: mm_init failed\n");
+	return 1;
+    }
+    board = mm_malloc(sizeof(board_t));
+    memset(board, 0, sizeof(board_t));
+    /* leave blocks of both sizes in this thread's cache for the children to inherit */
+    for (i = 0; i < NBLOCKS; i++)
+	p[i] = mm_malloc(i % 2 ? 24 : 40);
+    for (i = 0; i < NBLOCKS; i++)
+	mm_free(p[i]);
+
+    for (proc = 1; proc < PROCS; proc++) {
+	if (fork() == 0) {
+	    run(proc);
+	    exit(0);
+	}
+    }
+    run(0);
+    while (wait(&status) > 0)
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    ok = 0;
+    if (!ok)
+	return 1;
+    mm_free(board);
+    mm_checkheap(0);
+    printf("forktest: ok\n");
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * heaptest.c - Checks that the blocks of an mm_create heap stay in it
+ *
+ * Reallocates blocks of a heap across the slab and the mmap thresholds,
+ * checks that they never leave the heap's region for an arena or mapping
+ * of their own, and that mm_destroy leaves nothing of them reserved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+int verbose = 0;  /* mm_checkheap prints nothing more */
+
+void mm_checkheap(int verbose);
+
+/* The sizes each block is reallocated to in turn */
+static size_t sizes[] = {24, 200, 300, 5000, 200000, 400000, 100, 150000};
+
+#define NBLOCKS   4
+#define HEAP_MAX  (8 << 20)
+
+/*
+ * check - Fail with msg unless ok is set
+ */
+static void check(int ok, char *msg)
+{
+    if (!ok) {
+	printf("ERROR: %s\n", msg);
+	exit(1);
+    }
+}
+
+int main(void)
+{
+    mm_heap_t *h;
+    char *p[NBLOCKS], *lo, *hi;
+    size_t reserved, keep;
+    int i, j;
+
+#if MM_SHARED
+    /* a shared heap has no heaps of its own */
+    printf("heaptest: skipped, mm_create needs a build without SHARED=1\n");
+    return 0;
+#endif
+    mem_init();
+    check(mm_init() == 0, "mm_init failed");
+    check((h = mm_create(HEAP_MAX)) != NULL, "mm_create failed");
+    reserved = mm_reserved();
+
+    for (i = 0; i < NBLOCKS; i++) {
+	check((p[i] = mm_heap_malloc(h, 16)) != NULL, "mm_heap_malloc failed");
+	memset(p[i], i, 16);
+    }
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+	/* the payload up to the smaller of the two sizes must survive */
+	keep = j == 0 || sizes[j] < sizes[j - 1] ? sizes[j] : sizes[j - 1];
+	if (j == 0 && keep > 16)
+	    keep = 16;
+	for (i = 0; i < NBLOCKS; i++) {
+	    check((p[i] = mm_realloc(p[i], sizes[j])) != NULL, "mm_realloc failed");
+	    check(p[i][0] == i && p[i][keep - 1] == i, "mm_realloc lost the payload");
+	    memset(p[i], i, sizes[j]);
+	    lo = mem_heap_lo();
+	    hi = (char *)mem_heap_hi() + 1;
+	    check(p[i] >= lo && p[i] + sizes[j] <= hi, "mm_realloc moved a block out of the heap");
+	}
+	mm_checkheap(0);
+    }
+
+    mm_destroy(h);
+    mm_checkheap(0);
+    check(mm_reserved() == reserved, "mm_destroy left a block reserved");
+    printf("heaptest: ok\n");
+    return 0;
+}
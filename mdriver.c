@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE     /* sched_setaffinity */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,6 +16,8 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <sched.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -31,7 +34,7 @@
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
@@ -85,12 +88,20 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* What a worker process of -j sends back for its trace */
+typedef struct {
+    stats_t stats;   /* the trace's stats */
+    int errors;      /* errors the worker found */
+} result_t;
+
 /********************
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
+static int jobs = 1;    /* traces evaluated at once in worker processes (-j) */
+static int serial = 0;  /* if set, time the traces one at a time on one CPU (-s) */
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -121,6 +132,12 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
+static void eval_mm(int n, char **tracefiles, stats_t *stats, range_t **ranges);
+static void eval_mm_trace(int tracenum, char *tracefile, stats_t *stats, 
+			  range_t **ranges, int timed);
+static void eval_mm_jobs(int n, char **tracefiles, stats_t *stats, range_t **ranges);
+static void eval_mm_serial(int n, char **tracefiles, stats_t *stats, range_t **ranges);
+static void eval_mm_policies(int n, char **tracefiles, range_t **ranges);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
@@ -150,6 +167,7 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int policies = 0;    /* If set, report every placement policy (set by -p) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +176,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:j:hvVgalps")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +202,18 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'p': /* Report the results of every placement policy */
+            policies = 1;
+            break;
+        case 'j': /* Evaluate this many traces at once */
+            if ((jobs = atoi(optarg)) < 1) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 's': /* Time the traces one at a time, pinned to one CPU */
+            serial = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -296,24 +326,7 @@ int main(int argc, char **argv)
     mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
-    }
+    eval_mm(num_tracefiles, tracefiles, mm_stats, &ranges);
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -370,6 +383,12 @@ int main(int argc, char **argv)
 	printf("perfidx:%.0f\n", perfindex);
     }
 
+    /*
+     * Optionally run the traces again under each placement policy
+     */
+    if (policies)
+	eval_mm_policies(num_tracefiles, tracefiles, &ranges);
+
     exit(0);
 }
 
@@ -403,9 +422,10 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of a mapping */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -579,6 +599,208 @@ void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * eval_mm - Evaluate the mm malloc package on each of the n tracefiles
+ *     for correctness, space utilization and throughput, in jobs worker
+ *     processes at a time with -j, and timed apart from that with -s
+ */
+static void eval_mm(int n, char **tracefiles, stats_t *stats, range_t **ranges)
+{
+    int i;
+
+    if (jobs > 1)
+	eval_mm_jobs(n, tracefiles, stats, ranges);
+    else {
+	for (i=0; i < n; i++)
+	    eval_mm_trace(i, tracefiles[i], &stats[i], ranges, !serial);
+    }
+    if (serial)
+	eval_mm_serial(n, tracefiles, stats, ranges);
+}
+
+/*
+ * eval_mm_trace - Evaluate the mm malloc package on one tracefile, and
+ *     time it as well if timed is set
+ */
+static void eval_mm_trace(int tracenum, char *tracefile, stats_t *stats, 
+			  range_t **ranges, int timed)
+{
+    trace_t *trace;
+    speed_t speed_params;
+
+    trace = read_trace(tracedir, tracefile);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, ranges);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	stats->util = eval_mm_util(trace, tracenum, ranges);
+	if (timed) {
+	    speed_params.trace = trace;
+	    speed_params.ranges = *ranges;
+	    if (verbose > 1)
+		printf("and performance.\n");
+	    stats->secs = fsecs(eval_mm_speed, &speed_params);
+	}
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_jobs - Evaluate the n tracefiles in up to jobs worker processes
+ *     at a time. Each worker is forked with a copy of the memlib heap of
+ *     its own, and sends its stats back through a pipe. The workers time
+ *     their traces too, unless -s leaves that to eval_mm_serial.
+ */
+static void eval_mm_jobs(int n, char **tracefiles, stats_t *stats, range_t **ranges)
+{
+    pid_t *pids, pid;
+    int *fds, fd[2];
+    int i, next = 0, running = 0;
+    result_t result;
+
+    pids = (pid_t *)calloc(n, sizeof(pid_t));
+    fds = (int *)calloc(n, sizeof(int));
+    if (pids == NULL || fds == NULL)
+	unix_error("calloc failed in eval_mm_jobs");
+
+    /* so the workers do not print what is still buffered again */
+    fflush(stdout);
+    while (next < n || running > 0) {
+	/* start another worker while there are traces and room for it */
+	if (next < n && running < jobs) {
+	    if (pipe(fd) < 0)
+		unix_error("pipe failed in eval_mm_jobs");
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_mm_jobs");
+	    if (pid == 0) {
+		close(fd[0]);
+		errors = 0;
+		eval_mm_trace(next, tracefiles[next], &result.stats, ranges, !serial);
+		result.errors = errors;
+		fflush(stdout);
+		_exit(write(fd[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+	    }
+	    close(fd[1]);
+	    pids[next] = pid;
+	    fds[next++] = fd[0];
+	    running++;
+	    continue;
+	}
+
+	/* otherwise collect the stats of the next worker to finish */
+	if ((pid = wait(NULL)) < 0)
+	    unix_error("wait failed in eval_mm_jobs");
+	for (i = 0; i < next && pids[i] != pid; i++)
+	    ;
+	if (i == next)
+	    continue;
+	running--;
+	if (read(fds[i], &result, sizeof(result)) == sizeof(result)) {
+	    stats[i] = result.stats;
+	    errors += result.errors;
+	}
+	else {
+	    errors++;
+	    stats[i].valid = 0;
+	    printf("ERROR [trace %d]: the worker process for %s died.\n", i, tracefiles[i]);
+	}
+	close(fds[i]);
+    }
+    free(pids);
+    free(fds);
+}
+
+/*
+ * eval_mm_serial - Time the valid traces of the n tracefiles one after
+ *     another, pinned to the CPU we are running on so the timings do
+ *     not move between CPUs or compete with workers
+ */
+static void eval_mm_serial(int n, char **tracefiles, stats_t *stats, range_t **ranges)
+{
+    int i, cpu;
+    cpu_set_t old, set;
+    trace_t *trace;
+    speed_t speed_params;
+
+    /* pin only while timing, later workers are to spread over the CPUs */
+    if (sched_getaffinity(0, sizeof(old), &old) < 0)
+	unix_error("sched_getaffinity failed in eval_mm_serial");
+    if ((cpu = sched_getcpu()) >= 0) {
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+	    unix_error("sched_setaffinity failed in eval_mm_serial");
+    }
+
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	trace = read_trace(tracedir, tracefiles[i]);
+	if (verbose > 1)
+	    printf("Timing mm_malloc on %s.\n", tracefiles[i]);
+	speed_params.trace = trace;
+	speed_params.ranges = *ranges;
+	stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	free_trace(trace);
+    }
+
+    if (sched_setaffinity(0, sizeof(old), &old) < 0)
+	unix_error("sched_setaffinity failed in eval_mm_serial");
+}
+
+/*
+ * eval_mm_policies - Evaluate the mm malloc package once for each
+ *     placement policy of mm_policy and print a line of results for each.
+ *     Every policy runs with MM_FREE_LISTS_ONLY, or the slabs, tcaches
+ *     and quick lists would serve most requests before the policy does.
+ */
+static void eval_mm_policies(int n, char **tracefiles, range_t **ranges)
+{
+    static char *fits[] = {"good fit", "first fit", "next fit", "best fit"};
+    int p, i, errs;
+    char name[MAXLINE];
+    double secs, ops, util, thru, perfindex;
+    stats_t *stats;
+
+    if ((stats = (stats_t *)calloc(n, sizeof(stats_t))) == NULL)
+	unix_error("policy stats calloc in eval_mm_policies failed");
+
+    printf("\nResults for mm malloc by placement policy, slabs, tcaches and quick lists bypassed:\n");
+    printf("%-42s%6s%8s%6s\n", "policy", "util", "Kops", "perf");
+    for (p = 0; p <= (MM_FIT_MASK | MM_ADDR_ORDER | MM_SPLIT_END); p++) {
+	sprintf(name, "%s%s%s", fits[p & MM_FIT_MASK],
+		(p & MM_ADDR_ORDER) ? ", address order" : "",
+		(p & MM_SPLIT_END) ? ", split at end" : "");
+	mm_policy(p | MM_FREE_LISTS_ONLY);
+	errs = errors;
+	eval_mm(n, tracefiles, stats, ranges);
+	if (verbose) {
+	    printf("\nResults for %s:\n", name);
+	    printresults(n, stats);
+	}
+	if (errors != errs) {
+	    printf("%-42s%6s%8s%6s\n", name, "-", "-", "-");
+	    continue;
+	}
+
+	secs = ops = util = 0;
+	for (i=0; i < n; i++) {
+	    secs += stats[i].secs;
+	    ops += stats[i].ops;
+	    util += stats[i].util;
+	}
+	util /= n;
+	thru = ops/secs;
+	perfindex = UTIL_WEIGHT * util + (1.0 - UTIL_WEIGHT) *
+	    (thru > AVG_LIBC_THRUPUT ? 1.0 : thru/AVG_LIBC_THRUPUT);
+	printf("%-42s%5.0f%%%8.0f%6.0f\n", name, util*100.0, thru/1e3, perfindex*100.0);
+    }
+    free(stats);
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -696,11 +918,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   Utilization is the ratio hwm/peaksize, where peaksize is the 
+ *   most memory the heap and the mappings from mem_map took at once
+ *   while running the student's malloc package on the trace, as
+ *   memlib's mem_peaksize() reports it. The brk can move down, so
+ *   the peak counts the heap at its largest, not its size at the end.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
@@ -782,7 +1004,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peaksize());
 }
 
 
@@ -1012,13 +1234,16 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValps] [-f <file>] [-t <dir>] [-j <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate n traces at once in worker processes.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-p         Report the results of every placement policy.\n");
+    fprintf(stderr, "\t-s         Time the traces one at a time, pinned to one CPU.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
@@ -2,72 +2,276 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            Besides the sbrk heap it hands out page-aligned mappings with
+ *            mem_map, which are real anonymous mmaps kept on a list so the
+ *            driver can tell their payloads apart from stray pointers.
+ *            None of it is thread-safe, callers serialize.
+ *
+ *            mem_init_fd puts the heap in a shared mapping of a file or
+ *            memfd instead, so every process that maps it sees one heap
+ *            and one brk, though each at its own address.
+ *
+ *            mem_create carves a region of its own out of the heap, with
+ *            a brk that moves within it, for a heap that is thrown away
+ *            as a whole with mem_destroy.
  */
+#define _GNU_SOURCE             /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * The brk and the clean mark, as offsets from mem_start_brk. A heap in a
+ * file keeps them in the file's first page, where every process that maps
+ * it moves the same brk.
+ */
+typedef struct {
+    size_t brk;              /* end of the heap */
+    size_t clean;            /* memory from here up reads as zero */
+} mem_state_t;
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static mem_state_t mem_own;  /* the state of a private heap */
+static mem_state_t *mem_state = &mem_own;
+static size_t mem_mapped;    /* bytes in mappings */
+static size_t mem_peak;      /* most bytes of heap and mappings at once */
+
+/* A region handed out by mem_map */
+typedef struct mapping {
+    char *lo;
+    size_t size;
+    struct mapping *next;
+} mapping_t;
+static mapping_t *mappings;
+
+/* A region from mem_create, kept on mem_pool once destroyed */
+struct mem_heap {
+    char *lo;                /* first byte of the region */
+    size_t brk;              /* end of its heap, as an offset from lo */
+    size_t max;              /* size of the region */
+    struct mem_heap *next;   /* next destroyed region */
+};
+static mem_heap_t *mem_pool;
+
+static void mem_update_peak(void);
+static size_t mem_page_round(size_t size);
+static void mem_release(char *lo, char *hi);
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-        fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* map the storage we will use to model the available VM */
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+        fprintf(stderr, "mem_init_vm: mmap error\n");
         exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_state = &mem_own;
+    mem_state->brk = 0;                       /* heap is empty initially */
+    mem_state->clean = 0;                     /* and all of it is fresh */
+}
+
+/*
+ * mem_init_fd - initialize the memory system model with a heap kept in
+ *    the file fd, mapped shared. A file that is shorter than the heap can
+ *    grow is extended, reading as zero, which makes an empty heap. A file
+ *    another process uses already is attached to as it is.
+ */
+void mem_init_fd(int fd)
+{
+    size_t page = mem_pagesize();
+    struct stat st;
+    char *base;
+
+    if (fstat(fd, &st) < 0 ||
+        ((size_t)st.st_size < page + MAX_HEAP && ftruncate(fd, page + MAX_HEAP) < 0)) {
+        fprintf(stderr, "mem_init_fd: cannot size the heap file\n");
+        exit(1);
+    }
+    base = mmap(NULL, page + MAX_HEAP, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "mem_init_fd: mmap error\n");
+        exit(1);
+    }
+
+    mem_state = (mem_state_t *)base;          /* the first page holds the brk */
+    mem_start_brk = base + page;
+    mem_max_addr = mem_start_brk + MAX_HEAP;
 }
 
 /* 
- * mem_deinit - free the storage used by the memory system model
+ * mem_deinit - free the storage used by the memory system model. A heap
+ *    in a file is only unmapped, the file keeps it.
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    if (mem_state != &mem_own) {
+        munmap(mem_start_brk - mem_pagesize(), mem_pagesize() + MAX_HEAP);
+        mem_state = &mem_own;
+        return;
+    }
+    mem_reset_brk();
+    munmap(mem_start_brk, MAX_HEAP);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and unmap whatever mappings are left. Regions from mem_create are
+ *    gone with the heap, their handles must not be used again. The old
+ *    heap is not cleared, mem_heap_clean stays where it was.
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    mapping_t *m;
+    mem_heap_t *h;
+
+    while ((m = mappings) != NULL) {
+        mappings = m->next;
+        munmap(m->lo, m->size);
+        free(m);
+    }
+    mem_state->brk = 0;
+    mem_mapped = 0;
+    while ((h = mem_pool) != NULL) {
+        mem_pool = h->next;
+        free(h);
+    }
+    mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr shrinks the heap and gives the whole pages above
+ *    the new brk back to the system, they read as zero when the heap
+ *    grows over them again.
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk = mem_start_brk + mem_state->brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ((old_brk + incr < mem_start_brk) || ((old_brk + incr) > mem_max_addr)) {
         errno = ENOMEM;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
         return (void *)-1;
     }
-    mem_brk += incr;
+    mem_state->brk += incr;
+    if (incr < 0) {
+        /* everything dirty above the new brk goes, but its last partial page */
+        mem_release(old_brk + incr, mem_start_brk + mem_state->clean + mem_pagesize() - 1);
+        mem_state->clean = mem_page_round(mem_state->brk);
+    }
+    else if (mem_state->brk > mem_state->clean)
+        mem_state->clean = mem_state->brk;
+    mem_update_peak();
+    return (void *)old_brk;
+}
+
+/*
+ * mem_decommit - give the physical memory of the whole pages within
+ *    [lo, lo + size) of the heap back to the system. They stay part of
+ *    the heap and read as zero until they are written again.
+ */
+void mem_decommit(void *lo, size_t size)
+{
+    mem_release(lo, (char *)lo + size);
+}
+
+/*
+ * mem_create - reserve a region of max bytes, rounded up to whole pages,
+ *    at the brk for a heap of its own, reusing one that mem_destroy gave
+ *    back if it is large enough. Its brk starts at its first byte. Returns
+ *    NULL if the heap has no room for it.
+ */
+mem_heap_t *mem_create(size_t max)
+{
+    mem_heap_t **hp, *h;
+    char *lo;
+
+    max = mem_page_round(max);
+    for (hp = &mem_pool; (h = *hp) != NULL; hp = &h->next) {
+        if (h->max >= max) {
+            *hp = h->next;
+            h->brk = 0;
+            return h;
+        }
+    }
+    if (max > (size_t)(mem_max_addr - mem_start_brk) || (h = malloc(sizeof(mem_heap_t))) == NULL)
+        return NULL;
+    if ((lo = mem_sbrk((int)max)) == (void *)-1) {
+        free(h);
+        return NULL;
+    }
+    h->lo = lo;
+    h->brk = 0;
+    h->max = max;
+    return h;
+}
+
+/*
+ * mem_destroy - keep the region for mem_create to hand out again. What
+ *    lies below its brk stays as it is, mem_heap_sbrk down to the start
+ *    first gives all of its pages back in one call.
+ */
+void mem_destroy(mem_heap_t *h)
+{
+    h->next = mem_pool;
+    mem_pool = h;
+}
+
+/*
+ * mem_heap_sbrk - mem_sbrk for the heap in a region, which cannot grow
+ *    past the region's end. Returns (void *)-1 with errno ENOMEM if the
+ *    region is full.
+ */
+void *mem_heap_sbrk(mem_heap_t *h, int incr)
+{
+    char *old_brk = h->lo + h->brk;
+
+    if ((incr < 0 && (size_t)-incr > h->brk) || (incr > 0 && (size_t)incr > h->max - h->brk)) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    h->brk += incr;
+    if (incr < 0)
+        mem_release(old_brk + incr, old_brk);
     return (void *)old_brk;
 }
 
+/*
+ * mem_heap_start, mem_heap_brk, mem_heap_end - return the first byte of
+ *    the region, the end of its heap and the end of the region
+ */
+void *mem_heap_start(mem_heap_t *h)
+{
+    return (void *)h->lo;
+}
+
+void *mem_heap_brk(mem_heap_t *h)
+{
+    return (void *)(h->lo + h->brk);
+}
+
+void *mem_heap_end(mem_heap_t *h)
+{
+    return (void *)(h->lo + h->max);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -81,7 +285,17 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(mem_start_brk + mem_state->brk - 1);
+}
+
+/*
+ * mem_heap_clean - return the lowest address from which the memory above
+ *    the brk reads as zero, so that what mem_sbrk hands out from there up
+ *    is zeroed. It is above the brk where an earlier heap left data.
+ */
+void *mem_heap_clean()
+{
+    return (void *)(mem_start_brk + mem_state->clean);
 }
 
 /*
@@ -89,7 +303,15 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return mem_state->brk;
+}
+
+/*
+ * mem_maxsize() - returns the most bytes the heap can grow to
+ */
+size_t mem_maxsize()
+{
+    return MAX_HEAP;
 }
 
 /*
@@ -99,3 +321,136 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_map - map a fresh zeroed region of at least size bytes outside the
+ *    heap. The region is page-aligned. Returns NULL if mmap fails.
+ */
+void *mem_map(size_t size)
+{
+    mapping_t *m;
+    char *lo;
+
+    size = mem_page_round(size);
+    if ((m = malloc(sizeof(mapping_t))) == NULL)
+        return NULL;
+    lo = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lo == MAP_FAILED) {
+        free(m);
+        return NULL;
+    }
+    m->lo = lo;
+    m->size = size;
+    m->next = mappings;
+    mappings = m;
+    mem_mapped += size;
+    mem_update_peak();
+    return lo;
+}
+
+/*
+ * mem_remap - resize a region from mem_map to newsize bytes, moving it if
+ *    it cannot grow where it is. Returns NULL, with the old region intact,
+ *    if it fails.
+ */
+void *mem_remap(void *ptr, size_t oldsize, size_t newsize)
+{
+    mapping_t *m;
+    char *lo;
+
+    oldsize = mem_page_round(oldsize);
+    newsize = mem_page_round(newsize);
+    for (m = mappings; m != NULL && m->lo != ptr; m = m->next)
+        ;
+    if (m == NULL || m->size != oldsize) {
+        fprintf(stderr, "ERROR: mem_remap of %p that mem_map did not return\n", ptr);
+        return NULL;
+    }
+    if ((lo = mremap(ptr, oldsize, newsize, MREMAP_MAYMOVE)) == MAP_FAILED)
+        return NULL;
+    m->lo = lo;
+    m->size = newsize;
+    mem_mapped += newsize - oldsize;
+    mem_update_peak();
+    return lo;
+}
+
+/*
+ * mem_unmap - give back a region of size bytes from mem_map
+ */
+void mem_unmap(void *ptr, size_t size)
+{
+    mapping_t **mp, *m;
+
+    for (mp = &mappings; *mp != NULL && (*mp)->lo != ptr; mp = &(*mp)->next)
+        ;
+    if ((m = *mp) == NULL || m->size != mem_page_round(size)) {
+        fprintf(stderr, "ERROR: mem_unmap of %p that mem_map did not return\n", ptr);
+        return;
+    }
+    *mp = m->next;
+    munmap(m->lo, m->size);
+    mem_mapped -= m->size;
+    free(m);
+}
+
+/*
+ * mem_is_mapped - returns 1 if [lo, hi] lies within one mapping
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    mapping_t *m;
+
+    for (m = mappings; m != NULL; m = m->next) {
+        if ((char *)lo >= m->lo && (char *)hi < m->lo + m->size)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * mem_mapsize - returns the bytes in mappings from mem_map
+ */
+size_t mem_mapsize()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peaksize - returns the most bytes the heap and the mappings took
+ *    at any one time since the last mem_reset_brk
+ */
+size_t mem_peaksize()
+{
+    return mem_peak;
+}
+
+static void mem_update_peak(void)
+{
+    size_t size = mem_state->brk + mem_mapped;
+
+    if (size > mem_peak)
+        mem_peak = size;
+}
+
+static size_t mem_page_round(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    return (size + page - 1) / page * page;
+}
+
+/*
+ * madvise away the whole pages within [lo, hi). Dropping the pages of a
+ * shared mapping would leave the file's data, so those are removed from
+ * the file.
+ */
+static void mem_release(char *lo, char *hi)
+{
+    size_t page = mem_pagesize();
+
+    lo = (char *)(((size_t)lo + page - 1) / page * page);
+    hi = (char *)((size_t)hi / page * page);
+    if (lo < hi)
+        madvise(lo, hi - lo, mem_state == &mem_own ? MADV_DONTNEED : MADV_REMOVE);
+}
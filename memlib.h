@@ -1,11 +1,29 @@
 #include <unistd.h>
 
+typedef struct mem_heap mem_heap_t;
+
 void mem_init(void);               
+void mem_init_fd(int fd);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void mem_decommit(void *lo, size_t size);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_heap_clean(void);
 size_t mem_heapsize(void);
+size_t mem_maxsize(void);
 size_t mem_pagesize(void);
+void *mem_map(size_t size);
+void *mem_remap(void *ptr, size_t oldsize, size_t newsize);
+void mem_unmap(void *ptr, size_t size);
+int mem_is_mapped(void *lo, void *hi);
+size_t mem_mapsize(void);
+size_t mem_peaksize(void);
+mem_heap_t *mem_create(size_t max);
+void mem_destroy(mem_heap_t *h);
+void *mem_heap_sbrk(mem_heap_t *h, int incr);
+void *mem_heap_start(mem_heap_t *h);
+void *mem_heap_brk(mem_heap_t *h);
+void *mem_heap_end(mem_heap_t *h);
 
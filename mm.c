@@ -1,19 +1,33 @@
 /* 
- * mm.c -  Explicit free list, LIFO policy, and boundary tag coalescing. 
+ * mm.c -  Segregated explicit free lists, LIFO policy, and boundary tag coalescing. 
  *
- * Each block has header and footer of the form:
+ * Each block has a header of the form:
  * 
- *      31                     3  2  1  0 
- *      -----------------------------------
- *     | s  s  s  s  ... s  s  s  0  0  a/f
- *      ----------------------------------- 
+ *      31                     3  2  1    0 
+ *      -------------------------------------
+ *     | s  s  s  s  ... s  s  s d/r pa/pf a/f
+ *      ------------------------------------- 
  * 
- * where s are the meaningful size bits and a/f is set 
- * iff the block is allocated. 
+ * where s are the meaningful size bits, a/f is set iff the block
+ * is allocated and pa/pf is set iff the block before it is allocated.
+ * Bit 2 is d on free blocks, see Decommit, and r on allocated ones, see ReAllocate.
+ *
+ * Allocated blocks have no footer, the payload runs up to the next header:
+ *
+ *      ----------------------------------
+ *     |  header  |        payload        |
+ *      ----------------------------------
+ *
+ * Headers, footers and links are 32-bit words on 32- and 64-bit builds alike,
+ * so the minimum block is 16 bytes on both and the heap is limited to 4 GB.
+ *
+ * Only free blocks carry a footer, a copy of the header that coalesce
+ * reads to find the start of a free block from the block after it. The
+ * pa/pf bit tells coalesce whether there is a footer to read at all.
  *
  * Each free block also has a nextlink and a prevlink and looks like this 
- * (next- and prevlink are 32-bit addressess pointing to the next and previous 
- * (respectively) free blocks in the free list):
+ * (next- and prevlink are 32-bit offsets from the start of the heap to the next
+ * and previous (respectively) free blocks in the free list, 0 meaning NULL):
  *
  *      -------------------------------------------------------
  *     |  header  | nextlink | prevlink |  padding  |  footer  |
@@ -21,6 +35,22 @@
  *
  * Padding can be of varying size depending on the block size itself.
  *
+ * Free blocks of TREE_MIN bytes or more are not kept in a list but in a treap
+ * (a Cartesian tree with pseudo random priorities) ordered by size and then
+ * address. For those blocks nextlink and prevlink hold the left and right
+ * child, and the priority of a node is a hash of its address so it needs no
+ * storage. The expected depth is O(log n), which makes best fit over the
+ * large blocks O(log n) as well.
+ *
+ * Free blocks are kept in one of NUM_CLASSES segregated free lists, laid out
+ * as in TLSF: the first level splits sizes into powers of two and the second
+ * level splits each power of two into SL_COUNT linear ranges. Blocks smaller
+ * than SMALL_BLOCK get one class per ALIGNMENT step. A bitmap of non-empty
+ * first-level ranges and one bitmap of non-empty classes per first-level range
+ * are kept up to date by insertFront/removeFree, so the first non-empty class
+ * above a request is found with two bit scans. The classes only cover sizes
+ * below TREE_MIN.
+ *
  * The heaplist has the following form:
  *
  * begin                                                           end
@@ -32,7 +62,8 @@
  *          |        block        |                       |   block  |
  *
  * The allocated prologue and epilogue blocks are overhead that
- * eliminate edge conditions during coalescing.
+ * eliminate edge conditions during coalescing. heapEnd points at
+ * the epilogue block, its pa/pf bit tells if the last block is free.
  * 
  * +++++++++++++++++++++++++++++++
  *         Implementation:
@@ -41,25 +72,185 @@
  * The three main functions are mm_free, mm_malloc and mm_realloc,
  * they are implemented as described below.
  *
- * Free: When we are asked to free a block we set the block's header and footer
- * allocated bit to 0 and check if it can coalesce.
+ * Free: When we are asked to free a block we clear the allocated bit in its header,
+ * write its footer, clear the pa/pf bit of the next block and check if it can coalesce.
+ *
+ * Allocate: We look at the first FIT_SCAN blocks of the request's own size class for
+ * the best fit. If none of them fit we take the head of the first non-empty class above
+ * it, every block there is large enough. If there is no such class, or the request is
+ * TREE_MIN or more, we take the best fit from the tree. If that fails too, we extend the
+ * heap just enough so we can fit it.
+ *
+ * Policies: That is the good fit policy, MM_FIT_GOOD. mm_policy, or MM_POLICY at build
+ * time, picks first, next or best fit within the classes instead, keeps the class lists
+ * in address order rather than LIFO, or has small blocks split off the end of the free
+ * block they are placed in rather than its front (MM_SPLIT_END), so that they collect
+ * apart from the large ones. Small requests mostly never reach the policy, as slabs,
+ * tcaches and quick lists serve them, unless MM_FREE_LISTS_ONLY is set as well, which
+ * mdriver -p does when it reports the traces under every policy.
+ *
+ * Quick lists: With MM_QUICK set (the default) a freed block of up to QUICK_MAX bytes
+ * is not coalesced but pushed onto its arena's quick list for its exact size, one per
+ * size like the tcache bins, and the next request of that size pops it again without
+ * a split. Blocks on a quick list stay allocated as far as the heap is concerned. They
+ * are all freed and coalesced in one sweep when a request finds no fit and the heap
+ * would have to grow otherwise, when a free leaves a free block at the top of the
+ * heap or one of MM_TRIM_THRESHOLD bytes or more, and as soon as the lists hold more
+ * than QUICK_BYTES bytes, so that trimming and decommitting still see all the free
+ * space. A block with a free neighbour is coalesced right away instead.
+ *
+ * Threads: When built with MM_THREADS set (make THREADS=1) each arena is guarded by
+ * its own lock, and each thread keeps a cache (tcache) of recently freed small blocks
+ * in TCACHE_BINS bins, one per block size. mm_malloc and mm_free are served from
+ * the calling thread's cache without taking a lock. A cache miss refills the bin
+ * with TCACHE_BATCH blocks, and a full bin flushes half of its blocks back to the
+ * heap, both under a single lock acquisition. Cached blocks stay allocated as far
+ * as the heap is concerned. A thread's cache is flushed when it exits.
+ *
+ * Arenas: The free lists, bitmaps and tree above belong to an arena, and the
+ * thread-safe build has NUM_ARENAS of them (make ARENAS=n) so that threads do not
+ * all queue on one lock. A thread is given an arena round-robin the first time it
+ * allocates, or the arena of the CPU it runs on with MM_ARENA_CPU. Each arena grows
+ * its own segments of the memlib heap, every segment with a prologue and an epilogue
+ * of its own as in the picture above. An arena extends its last segment in place
+ * while it ends at the brk. Otherwise it starts a new segment at the next
+ * ARENA_CHUNK boundary, so no chunk is shared by two arenas and arenaMap, one byte
+ * per chunk, gives the arena of any block. mm_realloc uses it to lock the arena
+ * that owns the block. With one arena there is a single segment and the heap
+ * looks exactly as described above.
+ *
+ * Slabs: Requests of up to SLAB_MAX bytes are not served by blocks but by slabs, built
+ * with MM_SLABS set (the default). A slab is one heap block of SLAB_SIZE bytes whose
+ * payload starts on a SLAB_SIZE boundary (counted from heapLo), so the slab of any
+ * object is found by masking its address. The payload is a slab_t header followed by
+ * equal sized objects of one size, ALIGNMENT steps up to SLAB_MAX. Objects have no
+ * header or footer of their own, the header keeps their size and a bitmap with one
+ * bit per object, set iff it is allocated. Allocating an object is a bit scan of the
+ * first slab on the arena's list of slabs with free objects of its size, and freeing
+ * it clears its bit. slabMap, one bit per SLAB_SIZE page of the heap, is set for the
+ * pages that are slabs, which is how mm_free tells objects from blocks. Because the
+ * slab block is exactly SLAB_SIZE bytes its header sits in the last word of the page
+ * before, so two slabs can be next to each other in the heap. A slab that becomes
+ * empty is freed back to the heap unless it is the only one of its size.
+ *
+ * Trimming: When a free leaves a free block of MM_TRIM_THRESHOLD bytes or more at the
+ * end of the heap, all but TRIM_PAD bytes of it are given back with a negative mem_sbrk
+ * and the epilogue moves down. memlib returns the pages to the system, so a
+ * heap that shrinks after a burst also shrinks in memory. Only the segment at the brk
+ * can be trimmed, the others end where the next one begins.
+ *
+ * Decommit: A free block of MM_DECOMMIT_THRESHOLD bytes or more that is left in the
+ * middle of the heap keeps its address space but gives its physical memory back. Its
+ * interior, the whole pages between the links and the footer, is handed to
+ * mem_decommit and the d bit is set in its header. Those pages read as zero and are
+ * faulted back in when written, so nothing has to be done before the block is used
+ * again. Since the interior is a function of the block's address and size, each arena
+ * counts the bytes under its d blocks exactly: removeFree takes a block's interior
+ * off the count, and place keeps the d bit on a split remainder, whose interior lies
+ * within the old one. A block merged into a larger one loses its d bit and is
+ * decommitted again as a whole if the result is large enough. mm_reserved is the
+ * size of the heap and the mappings and mm_committed is that less the decommitted
+ * bytes, an upper bound on the memory in use.
+ *
+ * Huge blocks: Requests of MM_MMAP_THRESHOLD bytes or more do not come from the heap
+ * at all but from their own mem_map mapping, so they neither grow the heap nor leave
+ * a hole in it when they are freed. The mapping's length is kept in the DSIZE bytes
+ * before the payload. Mappings never lie within the heap, so a pointer below heapLo
+ * or at or above heapHi, the brk, is a huge block. mm_realloc resizes them with
+ * mem_remap, which does not copy.
+ *
+ * Batches: mm_malloc_batch takes one block for up to BATCH_RUN bytes worth of same
+ * sized blocks from the free lists or the heap and cuts it into them in place, all under
+ * one lock acquisition. Slab sized requests take their objects from slabs under the one
+ * lock instead. mm_free_batch sorts the pointers it is given, then frees each run of
+ * blocks that lie next to each other as one block, so the run costs one coalesce and
+ * one insertFront.
  *
- * Allocate: We find the best fitting free block of sufficient size with linear search.
- * If there is no match, we extend the heap just enough so we can fit it.
+ * Alignment: Payloads are ALIGNMENT aligned, 8 bytes by default or 16 with MM_ALIGNMENT
+ * (make ALIGNMENT=16) as the x86-64 ABI asks. Block sizes are multiples of it and the
+ * first block of a segment starts at a chunk boundary plus 16, so every payload is. For
+ * more, mm_memalign takes the best fit if the aligned payload fits in it with either
+ * nothing or a whole block after it, and otherwise a block with room for any alignment.
+ * The space in front of the payload goes back to the free lists as a block of its own,
+ * and place splits off the space after it.
  *
- * ReAllocate: If we are decreasing the block's size we simply split the block into two iff
- * the remainder is big enough to be a block.
+ * Sizes: mm_usable_size tells a caller how much it can use of a block, including what
+ * place left unsplit. A caller that passes mm_free_sized a size above SMALL_MAX skips
+ * the slab and tcache lookups, as such a block can be neither.
+ *
+ * Calloc: mm_calloc zeroes a block taken from the free lists, but one extendHeap made
+ * for it only below mem_heap_clean, where an earlier heap or a trim left data behind,
+ * and in the words it used as a free block. memlib's heap is an anonymous mapping, so
+ * the rest reads as zero without being touched, and huge blocks are fresh mappings.
+ *
+ * Sharing: Every link in the heap is an offset from heapLo, so the heap can sit at a
+ * different address in each process that maps it. With MM_SHARED (make SHARED=1) the
+ * arenas, the slab and arena maps and brkLock move from static memory into a shared_t
+ * at the start of the heap, and the locks are process-shared. With memlib's heap in a
+ * file or memfd (mem_init_fd), mm_init sets the heap up in the first process and only
+ * attaches to it in the ones after, which then allocate from and free into the same
+ * heap. Mappings are private to a process, so huge blocks stay in the heap then. A
+ * child forked after mm_init drops the tcache and arena it inherited, whose blocks
+ * are still the parent's.
+ *
+ * Persistence: Since the heap holds all of its state, a heap in a file outlives the
+ * processes that used it. mm_open maps the file and attaches to the heap in it as it was
+ * left, free lists and all, and mm_root finds the object mm_set_root made the way in.
+ * mm_close gives the thread's tcache back first, or its blocks would stay allocated. The
+ * file is only consistent when no process was killed in the middle of an operation.
+ *
+ * Heaps: mm_create starts a heap of its own in a region that mem_create reserves at the
+ * brk, for blocks that are thrown away together. It is an arena of its own, one of the
+ * MM_HEAPS after the threads' NUM_ARENAS, with one segment that grows at the region's brk
+ * instead of memlib's, and whose padding word holds where the region ends so mm_checkheap
+ * can step over it. mm_heap_malloc and mm_heap_free work on it like on any arena, and
+ * mm_free finds it through arenaMap too. mm_destroy drops the arena and gives the region
+ * back with one madvise, whatever is still allocated in it. Its blocks never go into a
+ * tcache, where they could outlive it, nor into mappings, and mm_realloc keeps them
+ * in it.
+ *
+ * Bump arenas: mm_arena_create gives a caller its own arena for objects that are never
+ * freed one by one. It takes chunks from mm_malloc and mm_arena_alloc cuts them up by
+ * moving a pointer, with no header, footer or coalescing per object. mm_arena_reset
+ * frees all but the first chunk, where the arena itself is kept. An arena has no lock
+ * and holds plain pointers, so it belongs to one thread of one process at a time.
+ *
+ * Remote frees: A block freed by a thread of another arena is not freed under the
+ * owner's lock but pushed onto the owner's remoteFrees stack, a lock-free list
+ * linked through the blocks' nextlinks. The owner takes the whole stack with one
+ * atomic exchange the next time it allocates under its lock, and frees the
+ * blocks then. Until that they stay allocated as far as the heap is concerned.
+ * So that they are not stranded in an arena no thread allocates from any more,
+ * a thread drains its arena when it exits, and the thread that pushes a block
+ * drains the stack itself if it gets the lock without waiting once REMOTE_MAX
+ * blocks are on it, or at once when the arena has no live threads left.
+ *
+ * ReAllocate: If we are decreasing the block's size we split the block into two iff
+ * the remainder is big enough to be a block, and free the remainder so it merges with
+ * a free block after it.
  * If we are increasing the block's size we first check if adjacent blocks are free and
- * of sufficient size for the block enlargement. If not, we allocate a new block, copy the data
- * and free the old block.
+ * of sufficient size for the block enlargement. If not, we move it to a free block that
+ * fits, and when there is none and the block ends the heap we extend the heap under it
+ * instead of moving it. Such a block keeps growing in place even past MM_MMAP_THRESHOLD.
+ * A block that mm_realloc grows has the r bit (bit 2, which means d on free blocks) set in
+ * its header. When it grows again it is given REALLOC_ROOM bytes more than asked for, so a
+ * buffer that is appended to repeatedly is moved or extended less and less often.
+ * Every payload that changes place goes through blockMove, which is safe for the
+ * overlapping move into the block before.
  *
  */
+#define _GNU_SOURCE                 /* sched_getcpu */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "mm.h"
 #include "memlib.h"
 
@@ -95,42 +286,439 @@ team_t team = {
 
 extern int verbose;
 
-#define ALIGNMENT 8
+/* Payload alignment, 16 for the x86-64 ABI with make ALIGNMENT=16 */
+#ifndef MM_ALIGNMENT
+#define MM_ALIGNMENT   8
+#endif
+#define ALIGNMENT MM_ALIGNMENT
+#if ALIGNMENT == 8
+#define ALIGN_LOG      3                                 /* log2(ALIGNMENT) */
+#elif ALIGNMENT == 16
+#define ALIGN_LOG      4
+#else
+#error "MM_ALIGNMENT must be 8 or 16"
+#endif
 #define WORD 4
-#define OVERHEAD 16
-#define HF_OVERHEAD 8
-/* rounds up to the nearest multiple of ALIGNMENT */
-#define GET(p)       (*(size_t *)(p))
-#define PUT(p, val)  (*(size_t *)(p) = (val))
+#define DSIZE 8
+#define OVERHEAD 16                 /* minimum block size */
+#define ALLOC_OVERHEAD WORD         /* allocated blocks only have a header */
+/* Adjusted block size of a request of size bytes, rounded up to a multiple of ALIGNMENT */
+#define ADJUST(size)   ((size) <= OVERHEAD - ALLOC_OVERHEAD ? OVERHEAD : \
+                        ALIGNMENT * (((size) + ALLOC_OVERHEAD + (ALIGNMENT-1)) / ALIGNMENT))
+/* Largest block a 32-bit header can describe */
+#define MAX_BLOCK      0xfffffff8U
+/* Read and write a 32-bit word at address p */
+#define GET(p)       (*(unsigned int *)(p))
+#define PUT(p, val)  (*(unsigned int *)(p) = (unsigned int)(val))
+/* Read and write a link at address p, stored as an offset from heapLo */
+#define GET_LINK(p)      (GET(p) == 0 ? NULL : heapLo + GET(p))
+#define PUT_LINK(p, bp)  PUT(p, (bp) == NULL ? 0 : (char *)(bp) - heapLo)
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
+#define PREV_ALLOC     0x2
+#define DECOMMITTED    0x4                               /* free block whose interior pages are decommitted */
+#define REALLOCED      0x4                               /* allocated block that mm_realloc has grown */
 #define GET_SIZE(p)    (GET(p) & ~0x7)
 #define GET_ALLOC(p)   (GET(p) & 0x1)
-/* Given block ptr bp, compute address of its header and footer */
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define GET_DECOMMITTED(p) (GET(p) & DECOMMITTED)
+#define GET_REALLOCED(p) (GET(p) & REALLOCED)
+/* the owner of the block may read its header without the lock, as GET_SIZE_UNLOCKED */
+#define GET_SIZE_UNLOCKED(p) (__atomic_load_n((unsigned int *)(p), __ATOMIC_RELAXED) & ~0x7)
+#define SET_PREV_ALLOC(p) __atomic_store_n((unsigned int *)(p), GET(p) | PREV_ALLOC, __ATOMIC_RELAXED)
+#define CLR_PREV_ALLOC(p) __atomic_store_n((unsigned int *)(p), GET(p) & ~PREV_ALLOC, __ATOMIC_RELAXED)
+/* Given block ptr bp, compute address of its header and footer (free blocks only) */
 #define HDRP(bp)       ((char *)(bp) - WORD)  
-#define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - ALIGNMENT)
-/* Given block ptr bp, compute address of next and previous blocks */
+#define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
+/* Given block ptr bp, compute address of next and previous blocks (the latter only if it is free) */
 #define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(((char *)(bp) - WORD)))
-#define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - ALIGNMENT)))
+#define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 /* Given block ptr bp, compute address of where it keeps it's next and prev address */
 #define NEXT_LINK(bp)  ((char *)(bp))
 #define PREV_LINK(bp)  ((char *)(bp) + WORD)
 /* Given block ptr bp, compute address of next and previous block in the free list */
-#define NEXT_OF(bp)    (GET(NEXT_LINK(bp)))
-#define PREV_OF(bp)    (GET(PREV_LINK(bp)))
+#define NEXT_OF(bp)    (GET_LINK(NEXT_LINK(bp)))
+#define PREV_OF(bp)    (GET_LINK(PREV_LINK(bp)))
+/* Free blocks of at least TREE_MIN bytes live in the tree, where the links are children */
+#define TREE_LOG       10
+#define TREE_MIN       (1 << TREE_LOG)
+#define LEFT_LINK(bp)  NEXT_LINK(bp)
+#define RIGHT_LINK(bp) PREV_LINK(bp)
+#define LEFT_OF(bp)    (GET_LINK(LEFT_LINK(bp)))
+#define RIGHT_OF(bp)   (GET_LINK(RIGHT_LINK(bp)))
+/* Treap priority of a tree node, a multiplicative hash of its address */
+#define PRIORITY(bp)   ((unsigned int)(((char *)(bp) - heapLo) >> ALIGN_LOG) * 2654435761U)
+/* Tree order: by size, then by address */
+#define TREE_LESS(a, b) (GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b)) || \
+                         (GET_SIZE(HDRP(a)) == GET_SIZE(HDRP(b)) && (char *)(a) < (char *)(b)))
+/* Two level segregated free list geometry, see sizeClass() */
+#define SL_LOG         3                                 /* log2 of classes per power of two */
+#define SL_COUNT       (1 << SL_LOG)
+#define FL_SHIFT       (SL_LOG + ALIGN_LOG)
+#define SMALL_BLOCK    (1 << FL_SHIFT)                   /* sizes below are one class per ALIGNMENT */
+#define FL_COUNT       (TREE_LOG - FL_SHIFT + 1)         /* larger sizes go in the tree */
+#define NUM_CLASSES    (FL_COUNT * SL_COUNT)
+/* How many blocks of the request's own class find_fit looks at before moving up */
+#define FIT_SCAN       8
+/* Placement policy unless mm_policy picks another (make POLICY=n), see mm.h */
+#ifndef MM_POLICY
+#define MM_POLICY      MM_FIT_GOOD
+#endif
+/* Blocks smaller than this go at the end of the free block with MM_SPLIT_END */
+#define SPLIT_SMALL    1024
+#define MIN(x, y)      ((x) < (y) ? (x) : (y))
+/* Most bytes mm_malloc_batch takes from the heap as one block */
+#define BATCH_RUN      (64 * 1024)
+/* Smallest chunk an mm_arena_create arena takes from mm_malloc at a time */
+#define BUMP_MIN       1024
+/* Room for the link to the chunk before at the start of each chunk */
+#define BUMP_HEAD      ALIGN(sizeof(char *))
+/* Headroom mm_realloc leaves a block that grows a second time */
+#define REALLOC_ROOM(size) ((size) / 4)
+/* Rounds up to the nearest multiple of ALIGNMENT */
+#define ALIGN(size)    (((size) + (ALIGNMENT-1)) & ~(size_t)(ALIGNMENT-1))
+
+/* Trimming, see the comment at the top of the file */
+#ifndef MM_TRIM_THRESHOLD
+#define MM_TRIM_THRESHOLD (128 * 1024)
+#endif
+#define TRIM_PAD       (MM_TRIM_THRESHOLD / 2)           /* free bytes left at the end after a trim */
+
+/* Decommit, see the comment at the top of the file */
+#ifndef MM_DECOMMIT_THRESHOLD
+#define MM_DECOMMIT_THRESHOLD (1024 * 1024)               /* high, reuse faults the pages back in */
+#endif
+#define PAGE_LOG       12
+#define PAGE_UP(p)     (heapLo + (((char *)(p) - heapLo + (1 << PAGE_LOG) - 1) & ~(size_t)((1 << PAGE_LOG) - 1)))
+#define PAGE_DOWN(p)   (heapLo + (((char *)(p) - heapLo) & ~(size_t)((1 << PAGE_LOG) - 1)))
+
+/* A heap shared between processes (make SHARED=1), see the comment at the top of the file */
+#ifndef MM_SHARED
+#define MM_SHARED      0
+#endif
+#define SHARED_MAGIC   0x6d6d7368                        /* "mmsh", set once the shared state is set up */
+
+/* Huge blocks, see the comment at the top of the file */
+#if MM_SHARED
+#undef MM_MMAP_THRESHOLD
+#define MM_MMAP_THRESHOLD MAX_BLOCK                       /* mappings are private, keep everything in the heap */
+#endif
+#ifndef MM_MMAP_THRESHOLD
+#define MM_MMAP_THRESHOLD (128 * 1024)
+#endif
+#define MAP_OVERHEAD   ALIGNMENT                         /* the mapping's length is kept before the payload */
+#define MAP_LEN(bp)    (*(size_t *)((char *)(bp) - MAP_OVERHEAD))
+#if MM_SHARED
+#define IS_MAPPED(p)   0
+#else
+#define IS_MAPPED(p)   ((char *)(p) < heapLo || (char *)(p) >= __atomic_load_n(&heapHi, __ATOMIC_RELAXED))
+#endif
+
+/* Slabs, see the comment at the top of the file */
+#ifndef MM_SLABS
+#define MM_SLABS       1
+#endif
+#define SLAB_LOG       12
+#define SLAB_SIZE      (1 << SLAB_LOG)                   /* one page, also the size of the slab's block */
+#define SLAB_MAX       256                               /* largest object kept in slabs */
+#define SLAB_CLASSES   (SLAB_MAX / ALIGNMENT + 1)        /* one per object size */
+#define SLAB_WORDS     (SLAB_SIZE / ALIGNMENT / 64)      /* bitmap words, enough for the smallest objects */
+#define SLAB_OBJS      (SLAB_SIZE - WORD - sizeof(slab_t)) /* bytes of a slab that hold objects */
+#define SLAB_PAGES     (1 << (32 - SLAB_LOG))            /* pages in a 4 GB heap */
+/* The slab an object lies in */
+#define SLAB_OF(p)     ((slab_t *)(heapLo + (((char *)(p) - heapLo) & ~(size_t)(SLAB_SIZE - 1))))
+/* Is p in a slab, and set or clear that bit for the page of p */
+#define SLAB_PAGE(p)   ((size_t)((char *)(p) - heapLo) >> SLAB_LOG)
+#define IS_SLAB(p)     ((__atomic_load_n(&slabMap[SLAB_PAGE(p) / 8], __ATOMIC_RELAXED) >> (SLAB_PAGE(p) % 8)) & 1)
+#define SET_SLAB(p)    __atomic_fetch_or(&slabMap[SLAB_PAGE(p) / 8], 1 << (SLAB_PAGE(p) % 8), __ATOMIC_RELAXED)
+#define CLR_SLAB(p)    __atomic_fetch_and(&slabMap[SLAB_PAGE(p) / 8], ~(1 << (SLAB_PAGE(p) % 8)), __ATOMIC_RELAXED)
+/* Is p a slab object, which it never is without slabs */
+#if MM_SLABS
+#define IS_SLAB_OBJ(p) IS_SLAB(p)
+#else
+#define IS_SLAB_OBJ(p) 0
+#endif
+
+/* Check the sizes passed to mm_free_sized (make DEBUG=1) */
+#ifndef MM_DEBUG
+#define MM_DEBUG       0
+#endif
+
+/* Quick lists, see the comment at the top of the file */
+#ifndef MM_QUICK
+#define MM_QUICK       1
+#endif
+#define QUICK_MAX      512                               /* largest block kept on a quick list */
+#define QUICK_BINS     (QUICK_MAX / ALIGNMENT + 1)       /* one list per block size */
+#define QUICK_BYTES    (32 * 1024)                       /* most bytes held on an arena's quick lists */
+
+/* Thread safety, see the comment at the top of the file */
+#ifndef MM_THREADS
+#define MM_THREADS     0
+#endif
+#define TCACHE_MAX     256                               /* largest block or object size kept in a tcache */
+#define TCACHE_BINS    (TCACHE_MAX / ALIGNMENT + 1)      /* one bin per size */
+#define TCACHE_COUNT   16                                /* most blocks in one bin */
+#define TCACHE_BATCH   8                                 /* blocks moved per refill or flush */
+/* Largest request a slab or a tcache may serve in this build, 0 if neither */
+#if MM_SLABS && MM_THREADS
+#define SMALL_MAX      (SLAB_MAX > TCACHE_MAX ? SLAB_MAX : TCACHE_MAX)
+#elif MM_SLABS
+#define SMALL_MAX      SLAB_MAX
+#elif MM_THREADS
+#define SMALL_MAX      TCACHE_MAX
+#else
+#define SMALL_MAX      0
+#endif
+#if MM_THREADS
+#define LOCK(a)        pthread_mutex_lock(&(a)->lock)
+#define TRYLOCK(a)     (pthread_mutex_trylock(&(a)->lock) == 0)
+#define UNLOCK(a)      pthread_mutex_unlock(&(a)->lock)
+#define BRK_LOCK()     pthread_mutex_lock(&brkLock)
+#define BRK_UNLOCK()   pthread_mutex_unlock(&brkLock)
+#else
+#define LOCK(a)
+#define TRYLOCK(a)     1
+#define UNLOCK(a)
+#define BRK_LOCK()
+#define BRK_UNLOCK()
+#endif
+#if MM_SHARED && !MM_THREADS
+#error "MM_SHARED needs MM_THREADS, the processes take the arenas' locks"
+#endif
+
+/* Arenas, see the comment at the top of the file */
+#ifndef MM_ARENAS
+#define MM_ARENAS      16
+#endif
+#if MM_THREADS
+#define NUM_ARENAS     MM_ARENAS
+#else
+#define NUM_ARENAS     1
+#endif
+#define REMOTE_MAX     32                                /* remote frees any thread may drain */
+/* Heaps of their own (mm_create), see the comment at the top of the file */
+#ifndef MM_HEAPS
+#define MM_HEAPS       16
+#endif
+#if MM_SHARED
+#undef MM_HEAPS
+#define MM_HEAPS       0                                 /* their memlib handles are private to a process */
+#endif
+#define ALL_ARENAS     (NUM_ARENAS + MM_HEAPS)           /* the threads' arenas, then one per heap */
+#if ALL_ARENAS > 256
+#error "arenaMap keeps arena numbers in bytes, NUM_ARENAS + MM_HEAPS must be at most 256"
+#endif
+/* Is a the arena of an mm_create heap, which grows within its region */
+#if MM_HEAPS
+#define OWN_HEAP(a)    ((a)->mem != NULL)
+#else
+#define OWN_HEAP(a)    0
+#endif
+#define CHUNK_LOG      16
+#define ARENA_CHUNK    (1 << CHUNK_LOG)                  /* segments of different arenas start on these */
+#define MAP_SIZE       (1 << (32 - CHUNK_LOG))           /* chunks in a 4 GB heap */
+/* Offset of p from heapLo rounded up to a chunk boundary */
+#define CHUNK_UP(p)    (((size_t)((char *)(p) - heapLo) + ARENA_CHUNK - 1) & ~(size_t)(ARENA_CHUNK - 1))
+/* The arena a block belongs to */
+#if ALL_ARENAS > 1
+#define ARENA_OF(bp)   (&arenas[arenaMap[((char *)(bp) - heapLo) >> CHUNK_LOG]])
+#else
+#define ARENA_OF(bp)   (&arenas[0])
+#endif
+/* True once more than one arena may be growing the heap */
+#if NUM_ARENAS == 1
+#define ARENAS_SHARED() 0
+#elif defined(MM_ARENA_CPU)
+#define ARENAS_SHARED() 1
+#else
+#define ARENAS_SHARED() (__atomic_load_n(&nextArena, __ATOMIC_RELAXED) > 1)
+#endif
+/* True if no live thread has a as its arena, one per CPU are never idle */
+#ifdef MM_ARENA_CPU
+#define ARENA_IDLE(a)  0
+#else
+#define ARENA_IDLE(a)  (__atomic_load_n(&(a)->threads, __ATOMIC_RELAXED) == 0)
+#endif
 
-static char *heapBegin;
-static char *heapEnd;
-static char *freeBegin;
+/* A thread's cache of free small blocks, linked through their nextlink */
+typedef struct {
+    char *bins[TCACHE_BINS];
+    unsigned char counts[TCACHE_BINS];
+    unsigned int generation;    /* heapGeneration the cached blocks belong to */
+    int registered;             /* set once the exit destructor is registered */
+} tcache_t;
 
-static void *extendHeap(size_t words);
-static void place(void *bp, size_t asize);
-static void *find_fit(size_t asize);
-static void *coalesce(void *bp);
+/* Header at the start of a slab's payload, the objects follow it */
+typedef struct {
+    unsigned int next;                      /* next slab with free objects of this size, as a link */
+    unsigned int prev;                      /* previous one, as a link */
+    unsigned short size;                    /* object size */
+    unsigned short count;                   /* objects in the slab */
+    unsigned short free;                    /* objects not allocated */
+    unsigned short unused;
+    unsigned long long used[SLAB_WORDS];    /* bit i set iff object i is allocated or past count */
+} slab_t;
+
+/* A bump arena of mm_arena_create, kept in its first chunk after the link */
+struct mm_arena {
+    char *next;                             /* where the next object starts */
+    char *end;                              /* end of the chunk next is in */
+    char *chunks;                           /* newest chunk, each starts with a pointer to the one before */
+    size_t chunk;                           /* bytes mm_arena_alloc asks mm_malloc for at a time */
+};
+
+/* An independent heap: the free blocks of its segments and the lock that guards them */
+typedef struct mm_heap {
+    unsigned int heapEnd;                   /* epilogue of the arena's last segment as a link, 0 if none */
+    unsigned int slabs[SLAB_CLASSES];       /* slabs with free objects of each size, as links */
+    unsigned int freeLists[NUM_CLASSES];    /* first block of each size class, as links */
+    unsigned int flBitmap;                  /* bit fl set iff some class in first level fl is non-empty */
+    unsigned int slBitmap[FL_COUNT];        /* bit sl set iff class fl * SL_COUNT + sl is non-empty */
+    unsigned int treeRoot;                  /* root of the tree of large free blocks, as a link */
+    unsigned int rover;                     /* free block MM_FIT_NEXT searches on from, as a link */
+    size_t decommitted;                     /* bytes in the interiors of the d blocks */
+#if MM_QUICK
+    unsigned int quick[QUICK_BINS];         /* freed blocks of each size not coalesced yet, as links */
+    unsigned int quickBytes;                /* bytes of the blocks on all of them */
+#endif
+#if MM_HEAPS
+    mem_heap_t *mem;                        /* region of an mm_create heap, NULL for the threads' arenas */
+#endif
+#if MM_THREADS
+    pthread_mutex_t lock;
+    unsigned int remoteFrees __attribute__((aligned(64))); /* blocks freed by other arenas' threads, as a link */
+    int remoteCount;                        /* blocks on it, about */
+    int threads;                            /* live threads it is the arena of, kept by mm_init */
+#endif
+} __attribute__((aligned(64))) arena_t;
+
+static char *heapLo;                        /* mem_heap_lo(), the base of all links */
+static char *heapBegin;                     /* prologue of the first segment */
+static char *heapHi;                        /* the brk, payloads outside [heapLo, heapHi) are mapped */
+static int policy = MM_POLICY;              /* placement policy, the MM_FIT_* and flags of mm.h */
+#if MM_SHARED
+/* The state every process attached to the heap shares, kept at its start */
+typedef struct {
+    unsigned int magic;                     /* SHARED_MAGIC once mm_init has set it up */
+    unsigned int size;                      /* sizeof(shared_t), a heap of another build differs */
+    unsigned int root;                      /* the root object, as a link */
+    pthread_mutex_t brkLock;
+    arena_t arenas[ALL_ARENAS];
+#if MM_SLABS
+    unsigned char slabMap[SLAB_PAGES / 8];
+#endif
+#if NUM_ARENAS > 1
+    unsigned char arenaMap[MAP_SIZE];
+    unsigned int nextArena;
+#endif
+} shared_t;
+static shared_t *shared;                    /* heapLo, where this process maps the heap */
+#define arenas         (shared->arenas)
+#define slabMap        (shared->slabMap)
+#define arenaMap       (shared->arenaMap)
+#define nextArena      (shared->nextArena)
+#define brkLock        (shared->brkLock)
+#else
+static arena_t arenas[ALL_ARENAS];
+#if MM_SLABS
+static unsigned char slabMap[SLAB_PAGES / 8];   /* bit set iff the page is a slab */
+#endif
+#if ALL_ARENAS > 1
+static unsigned char arenaMap[MAP_SIZE];    /* arena of each chunk of the heap */
+#endif
+#if NUM_ARENAS > 1
+static unsigned int nextArena;              /* round-robin arena assignment */
+#endif
+#if MM_THREADS
+static pthread_mutex_t brkLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#endif
+#if NUM_ARENAS > 1
+static __thread unsigned int threadArena;   /* index + 1 of the thread's arena, 0 until it has one */
+#endif
+#if MM_THREADS
+static unsigned int heapGeneration;         /* bumped by mm_init, stale tcaches are dropped */
+static pthread_key_t tcacheKey;
+static pthread_once_t tcacheOnce = PTHREAD_ONCE_INIT;
+static __thread tcache_t tcache;
+#endif
+#if MM_SHARED
+static pthread_once_t forkOnce = PTHREAD_ONCE_INIT;
+#endif
+
+static arena_t *arenaGet(void);
+static void arenaReset(arena_t *a);
+static void *mapBlock(size_t size);
+static int ptrCompare(const void *x, const void *y);
+static void *bumpChunk(mm_arena_t *r, size_t size);
+static void *remapBlock(void *bp, size_t size);
+static void unmapBlock(void *bp);
+#if NUM_ARENAS > 1
+static void remotePush(arena_t *a, void *bp);
+static void remoteDrain(arena_t *a);
+#endif
+static void *allocBlock(arena_t *a, size_t asize);
+static void *callocBlock(arena_t *a, size_t asize, size_t size, size_t *dirty);
+static void freeBlock(arena_t *a, void *ptr);
+static int trimHeap(arena_t *a, void *bp);
+static void decommitBlock(arena_t *a, void *bp);
+static size_t interior(void *bp, char **lo);
+static void freeAny(arena_t *a, void *ptr);
+#if MM_QUICK
+static int quickFree(arena_t *a, void *bp);
+static void *quickAlloc(arena_t *a, size_t asize);
+static int quickMerge(arena_t *a);
+#endif
+static void *allocAligned(arena_t *a, size_t asize, size_t align);
+static size_t alignGap(void *bp, size_t align);
+static int alignFits(void *bp, size_t asize, size_t align);
+#if MM_SLABS
+static void *slabAlloc(arena_t *a, size_t size);
+static void slabFree(arena_t *a, void *ptr);
+static slab_t *slabNew(arena_t *a, size_t size);
+static void slabUnlink(arena_t *a, slab_t *s);
+static void checkslab(slab_t *s);
+#endif
+static void *reallocBlock(arena_t *a, void *ptr, size_t size);
+static void shrinkBlock(arena_t *a, void *bp, size_t asize);
+static void blockMove(void *dst, const void *src, size_t n);
+static int growBlock(arena_t *a, void *bp, size_t newSize, size_t want, int extend);
+#if MM_THREADS
+static void *cacheMalloc(size_t size);
+static int cacheFree(void *ptr);
+static tcache_t *cacheGet(void);
+static void cacheFlush(tcache_t *tc, int bin, int keep);
+static void cacheExit(void *tc);
+static void cacheKeyInit(void);
+#endif
+#if MM_SHARED
+static void forkChild(void);
+static void forkInit(void);
+#endif
+
+static void *extendHeap(arena_t *a, size_t asize, char **clean);
+static void openSegment(arena_t *a);
+static void mapChunks(arena_t *a, char *lo, char *hi);
+static char *arenaBrk(arena_t *a);
+static void *arenaSbrk(arena_t *a, size_t incr);
+static void arenaShrink(arena_t *a, size_t decr);
+static void place(arena_t *a, void *bp, size_t asize);
+static void *find_fit(arena_t *a, size_t asize);
+static void *classFit(char *bp, size_t asize, int scan, int first);
+static void *nextFit(arena_t *a, int class, size_t asize);
+static void *placeFit(arena_t *a, void *bp, size_t asize);
+static void *coalesce(arena_t *a, void *bp);
 static void printblock(void *bp); 
 static void checkblock(void *bp);
-static void removeFree(void *wp);
-static void insertFront(void *bp);
+static void removeFree(arena_t *a, void *wp);
+static void insertFront(arena_t *a, void *bp);
+static int sizeClass(size_t size);
+static int nextClass(arena_t *a, int class);
+static void treeInsert(arena_t *a, void *bp);
+static void treeRemove(arena_t *a, void *bp);
+static void *treeFit(arena_t *a, size_t asize);
+static size_t checktree(void *bp, void *lo, void *hi);
 void mm_checkheap(int verbose);
 size_t contains(void *bp);
 
@@ -140,409 +728,2243 @@ size_t contains(void *bp);
  */
 int mm_init(void)
 {
-    if ((heapBegin = mem_sbrk(4 * (WORD))) == NULL) {
+    int i;
+#if MM_THREADS
+    pthread_mutexattr_t attr;
+#endif
+
+    heapLo = mem_heap_lo();
+#if MM_SHARED
+    pthread_once(&forkOnce, forkInit);
+    shared = (shared_t *)heapLo;
+    heapBegin = heapLo + CHUNK_UP(heapLo + sizeof(shared_t)) + DSIZE;
+    if (mem_heapsize() != 0) {
+        /* another process, or an earlier run, has set the heap up, attach to it */
+        if (__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC || shared->size != sizeof(shared_t))
+            return -1;
+        __atomic_add_fetch(&heapGeneration, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+    if (mem_sbrk(sizeof(shared_t)) == (void *)-1)
         return -1;
+    memset(shared, 0, sizeof(shared_t));
+#else
+    heapBegin = heapLo + DSIZE;
+#endif
+#if MM_THREADS
+    pthread_mutexattr_init(&attr);
+#if MM_SHARED
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&brkLock, &attr);
+#endif
+#endif
+    for (i = 0; i < ALL_ARENAS; i++) {
+        arenaReset(&arenas[i]);
+#if MM_HEAPS
+        arenas[i].mem = NULL;
+#endif
+#if MM_THREADS
+        pthread_mutex_init(&arenas[i].lock, &attr);
+#endif
     }
-    PUT(heapBegin, 0);                               /* Create padding */
-    PUT(heapBegin + WORD, PACK(ALIGNMENT, 1));       /* Create prologue header */
-    PUT(heapBegin + ALIGNMENT, PACK(ALIGNMENT, 1));  /* Create prologue footer */
-    PUT(heapBegin + ALIGNMENT + WORD, PACK(0, 1));   /* Create epilogue header */
-    heapBegin += ALIGNMENT;
-    heapEnd = heapBegin;
-    freeBegin = NULL;
+#if MM_THREADS
+    pthread_mutexattr_destroy(&attr);
+#endif
+    /* the first arena's segment starts the heap */
+    openSegment(&arenas[0]);
+    if (arenas[0].heapEnd == 0)
+        return -1;
+#if MM_THREADS
+    /* blocks cached by any thread belong to the old heap now */
+    __atomic_add_fetch(&heapGeneration, 1, __ATOMIC_RELEASE);
+#endif
+#if MM_SHARED
+    shared->size = sizeof(shared_t);
+    __atomic_store_n(&shared->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+#endif
 
     return 0;
 }
+/*
+ * Initialize the malloc package on the heap kept in the file at path,
+ * creating the file if there is none. A heap that is there already is
+ * attached to as it is, nothing in it is rebuilt. Returns -1 unless the
+ * allocator is built with MM_SHARED, whose heap alone lives in a file.
+ */
+int mm_open(const char *path)
+{
+#if MM_SHARED
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+        return -1;
+    mem_init_fd(fd);
+    close(fd);
+    return mm_init();
+#else
+    return -1;
+#endif
+}
+/*
+ * Detach from the heap mm_open attached to. The calling thread's cached
+ * blocks go back to the heap first, other threads must have exited.
+ */
+void mm_close(void)
+{
+#if MM_SHARED
+    cacheExit(&tcache);
+    mem_deinit();
+#endif
+}
+/*
+ * Returns the root object, the one block that whoever opens the heap next
+ * can find without being told where it is. NULL without MM_SHARED.
+ */
+void *mm_root(void)
+{
+#if MM_SHARED
+    return GET_LINK(&shared->root);
+#else
+    return NULL;
+#endif
+}
+/*
+ * Make ptr the root object, or clear it with NULL. Does nothing without
+ * MM_SHARED.
+ */
+void mm_set_root(void *ptr)
+{
+#if MM_SHARED
+    __atomic_store_n(&shared->root, ptr == NULL ? 0 : (char *)ptr - heapLo, __ATOMIC_RELEASE);
+#endif
+}
+/*
+ * Choose how blocks are placed in the free blocks, see mm.h. Takes effect
+ * for the next allocation, call it before mm_init to get the policy's
+ * free list order from the start.
+ */
+void mm_policy(int p)
+{
+    policy = p;
+}
 /* 
- * Allocate a block from the freelist or extend heap to fit it.
- * Always allocate a block whose size is a multiple of the alignment.
+ * Allocate an object from the thread's cache or a slab, or a block from the heap.
  */
 void *mm_malloc(size_t size)
 {
     size_t asize;      /* adjusted block size */
-    size_t extendsize; /* amount to extend heap if no fit */
+    arena_t *a;
     char *bp;      
 
-    /* Ignore spurious requests */
-    if (size <= 0)
+    /* Ignore spurious requests, and ones too large for a 32-bit header */
+    if (size <= 0 || size > MAX_BLOCK - ALIGNMENT)
         return NULL;
+    if (size >= MM_MMAP_THRESHOLD)
+        return mapBlock(size);
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= ALIGNMENT)
-        asize = ALIGNMENT + HF_OVERHEAD;
-    else
-        asize = ALIGNMENT * ((size + (HF_OVERHEAD) + (ALIGNMENT-1)) / ALIGNMENT);
-    
-    /* Search the free list for a fit */
-    if ((bp = find_fit(asize)) != NULL) {
-        place(bp, asize);
-        //mm_checkheap(verbose);
+#if MM_SLABS
+    if (size <= SLAB_MAX && !(policy & MM_FREE_LISTS_ONLY)) {
+#if MM_THREADS
+        return cacheMalloc(ALIGN(size));
+#else
+        a = arenaGet();
+        LOCK(a);
+        bp = slabAlloc(a, ALIGN(size));
+        UNLOCK(a);
         return bp;
+#endif
     }
-    /* No fit found. Get more memory and place the block */
-    if (!GET_ALLOC(heapEnd))
-    {
-        /* last block is free, so extend heap just enough to be able to insert the new block */
-        extendsize = asize - GET_SIZE(heapEnd);
-    } else
-        extendsize = asize;
-
-    if ((bp = extendHeap(extendsize/WORD)) == NULL)
-        return NULL;
-
-    place(bp, asize);
+#endif
+    /* Adjust block size to include overhead and alignment reqs. */
+    asize = ADJUST(size);
+#if MM_THREADS && !MM_SLABS
+    if (asize <= TCACHE_MAX && !(policy & MM_FREE_LISTS_ONLY))
+        return cacheMalloc(asize);
+#endif
 
+    a = arenaGet();
+    LOCK(a);
+    bp = allocBlock(a, asize);
+    UNLOCK(a);
     return bp;
 }
 /*
- * Freeing a block does everything.
+ * Free a block into the thread's cache, or back to the heap.
  */
 void mm_free(void *ptr)
 {
-    size_t size = GET_SIZE(HDRP(ptr));
-    PUT(HDRP(ptr), PACK(size, 0));
-    PUT(FTRP(ptr), PACK(size, 0));
-    coalesce(ptr);
-    /* Jess ég er frír! */
+    arena_t *a;
+
+    if (IS_MAPPED(ptr)) {
+        unmapBlock(ptr);
+        return;
+    }
+#if MM_THREADS
+    if (cacheFree(ptr))
+        return;
+#endif
+    a = ARENA_OF(ptr);
+#if NUM_ARENAS > 1
+    if (a != arenaGet()) {
+        remotePush(a, ptr);
+        return;
+    }
+#endif
+    LOCK(a);
+    freeAny(a, ptr);
+    UNLOCK(a);
 }
 /*
- * Reallocates the block to it's new size and returns a pointer to the block.
+ * Allocate nmemb zeroed elements of size bytes each. Only what may hold old
+ * data is cleared, memory fresh from memlib or the system is zero already.
  */
-void *mm_realloc(void *ptr, size_t size)
+void *mm_calloc(size_t nmemb, size_t size)
 {
-    if (size == 0) {
-        mm_free(ptr);
-        return ptr;
-    }
-    if (ptr == NULL) {
-        if ((ptr = mm_malloc(size)) == NULL) {
-            printf("ERROR: mm_malloc failed in mm_realloc\n");
-            exit(1);
-        } else
-            return ptr;
-    }
-
-    size_t oldSize = GET_SIZE(HDRP(ptr));
-    size_t newSize;
-
-    /* ReAllocate the block pointed to by ptr (change the block size) */
-    if (size <= ALIGNMENT)                  /* adjusting the size */
-        newSize = ALIGNMENT + HF_OVERHEAD;
-    else
-        newSize = ALIGNMENT * ((size + (HF_OVERHEAD) + (ALIGNMENT-1)) / ALIGNMENT);
-
-    if (newSize == oldSize) return ptr;
-    if (newSize > oldSize) { 
-        
-        void *prevp = PREV_BLKP(ptr), *nextp = NEXT_BLKP(ptr);
-
-        if ((GET_SIZE(HDRP(nextp)) + oldSize >= newSize) && !GET_ALLOC(HDRP(nextp))) {
-            /* merging ptr block and the next one is big enough. */
-            removeFree(nextp);
-            PUT(HDRP(ptr), PACK((GET_SIZE(HDRP(nextp)) + oldSize), 1));
-            PUT(FTRP(ptr), PACK((GET_SIZE(HDRP(nextp)) + oldSize), 1));
-            place(ptr, newSize);
-            return ptr;
-        } else if ((GET_SIZE(HDRP(prevp)) + oldSize >= newSize) && !GET_ALLOC(HDRP(prevp))) {
-            /* merging ptr block and the prev one is big enough. */
-            removeFree(prevp);
-            PUT(HDRP(prevp), PACK((GET_SIZE(HDRP(prevp)) + oldSize), 1));
-            PUT(FTRP(prevp), PACK((GET_SIZE(HDRP(prevp)) + oldSize), 1));
-            memcpy(prevp, ptr, oldSize);
-            place(prevp, newSize);
-            return prevp;
-        } else if (((GET_SIZE(HDRP(prevp)) + GET_SIZE(HDRP(nextp)) + oldSize) >= newSize) && !GET_ALLOC(HDRP(prevp)) && !GET_ALLOC(HDRP(nextp))) {
-            /* merging ptr block and both next and prev is big enough. */
-            removeFree(prevp);
-            removeFree(nextp);
-            PUT(HDRP(prevp), PACK((GET_SIZE(HDRP(prevp)) + oldSize + GET_SIZE(HDRP(nextp))), 1));
-            PUT(FTRP(prevp), PACK((GET_SIZE(HDRP(prevp)) + oldSize + GET_SIZE(HDRP(nextp))), 1));
-            memcpy(prevp, ptr, oldSize);
-            place(prevp, newSize);
-            return prevp;
-        } else {
-            /* we will need to create a new block on the heap and free the old one */
-            void *nptr;
-            if ((nptr = mm_malloc(size)) == NULL) {
-                printf("ERROR: mm_malloc failed in mm_realloc\n");
-                exit(1);
-            } else {
-                memcpy(nptr, ptr, oldSize);
-                mm_free(ptr);
-                return nptr;
-            }
-        }
+    size_t dirty;
+    arena_t *a;
+    char *bp;
 
-    } else {
-        place(ptr, newSize);
+    if (nmemb != 0 && size > (size_t)-1 / nmemb)
+        return NULL;
+    size *= nmemb;
+    /* mappings are fresh, small blocks are not worth telling apart */
+    if (size >= MM_MMAP_THRESHOLD)
+        return mm_malloc(size);
+    if (size <= SMALL_MAX) {
+        if ((bp = mm_malloc(size)) != NULL)
+            memset(bp, 0, size);
+        return bp;
     }
-    return ptr;
+
+    a = arenaGet();
+    LOCK(a);
+    bp = callocBlock(a, ADJUST(size), size, &dirty);
+    UNLOCK(a);
+    if (bp != NULL)
+        memset(bp, 0, dirty);
+    return bp;
 }
 /*
- * Extend heap with free block and return its block pointer
- */ 
-static void *extendHeap(size_t words) 
+ * Allocate a block of size bytes whose payload starts on an align boundary,
+ * align a power of two. Alignments above ALIGNMENT are served by a heap block
+ * even when size is small or huge, since neither slab objects nor mappings
+ * have them. Returns NULL with errno EINVAL for an align that is not a power
+ * of two and ENOMEM for one no block can have, like posix_memalign.
+ */
+void *mm_memalign(size_t align, size_t size)
 {
+    arena_t *a;
     char *bp;
-    size_t size;
 
-    /* Allocate an even number of words to maintain alignment */
-    size = (words % 2) ? (words+1) * WORD : words * WORD;
-    if ((bp = mem_sbrk(size)) == (void *)-1) 
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
         return NULL;
+    }
+    if (align <= ALIGNMENT)
+        return mm_malloc(size);
+    /* checked first, 2 * align wraps for the largest ones */
+    if (align > MAX_BLOCK / 2 || size <= 0 || size > MAX_BLOCK - 2 * (align + OVERHEAD)) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    /* Initialize free block header/footer and the epilogue header */
-    PUT(NEXT_LINK(bp), 0);                      /* nextlink points to NULL */
-    PUT(PREV_LINK(bp), 0);                      /* prevlink points to NULL */
-    PUT(HDRP(bp), PACK(size, 0));               /* free block header */
-    PUT(FTRP(bp), PACK(size, 0));               /* free block footer */
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));       /* new epilogue header */
-    heapEnd = FTRP(bp);                         /* put heapEnd to where it's supposed to be */
-
-    /* Coalesce if the previous block was free */
-    return coalesce(bp);
+    a = arenaGet();
+    LOCK(a);
+    bp = allocAligned(a, ADJUST(size), align);
+    UNLOCK(a);
+    return bp;
 }
 /*
- * Boundary tag coalescing. Return ptr to coalesced block
- */ 
-static void *coalesce(void *bp) 
+ * Free a block the caller knows to hold at least size bytes. A size larger
+ * than any slab object or cached block lets it go straight to the heap.
+ */
+void mm_free_sized(void *ptr, size_t size)
 {
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-    size_t size = GET_SIZE(HDRP(bp));
-    void *wp = bp;
+    arena_t *a;
 
-    if (prev_alloc && !next_alloc) {           /* Coalesce with block to the right */
-        wp = NEXT_BLKP(bp);
-        size += GET_SIZE(HDRP(wp));
-        removeFree(wp);
+#if MM_DEBUG
+    if (size > mm_usable_size(ptr)) {
+        printf("Error: mm_free_sized of %p with %lu bytes, it only has %lu!\n",
+               ptr, (unsigned long)size, (unsigned long)mm_usable_size(ptr));
+        exit(1);
     }
-    else if (!prev_alloc && next_alloc) {      /* Coalesce with block to the left */
-     	wp = PREV_BLKP(bp);
-        size += GET_SIZE(HDRP(wp));
-        removeFree(wp);
-        bp = wp;
+#endif
+    if (size <= SMALL_MAX || IS_MAPPED(ptr)) {
+        mm_free(ptr);
+        return;
     }
-    else if (!prev_alloc && !next_alloc) {      /* Coalesce with both blocks  */
-        wp = NEXT_BLKP(bp);
-        size += GET_SIZE(HDRP(wp));
-        removeFree(wp);
-        wp = PREV_BLKP(bp);
-        size += GET_SIZE(HDRP(wp));
-        removeFree(wp);
-    	bp = wp;
+    a = ARENA_OF(ptr);
+#if NUM_ARENAS > 1
+    if (a != arenaGet()) {
+        remotePush(a, ptr);
+        return;
     }
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
-
-    insertFront(bp);
-
-    return bp;
+#endif
+    LOCK(a);
+#if MM_QUICK
+    if (!quickFree(a, ptr))
+#endif
+        freeBlock(a, ptr);
+    UNLOCK(a);
 }
 /*
- * Inserts the free block at the front of the freelist.
- */ 
-static void insertFront(void *bp) 
+ * Returns how many bytes the block can hold, which can be more than it was
+ * allocated with when place leaves a remainder too small to split off.
+ */
+size_t mm_usable_size(void *ptr)
 {
-    if (freeBegin != NULL) {
-    	PUT(bp, (size_t)freeBegin);
-	PUT(PREV_LINK(freeBegin), (size_t)bp);
-    } else {
-    	PUT(NEXT_LINK(bp), 0);
-    }
-    PUT(PREV_LINK(bp), 0);
-    freeBegin = bp;
+    if (ptr == NULL)
+        return 0;
+    if (IS_MAPPED(ptr))
+        return MAP_LEN(ptr) - MAP_OVERHEAD;
+#if MM_SLABS
+    if (IS_SLAB(ptr))
+        return SLAB_OF(ptr)->size;
+#endif
+    return GET_SIZE_UNLOCKED(HDRP(ptr)) - ALLOC_OVERHEAD;
 }
 /*
- * Removes the block from the freelist.
+ * Allocate n blocks of size bytes into out under one lock acquisition.
+ * Returns how many it allocated, fewer than n only if memory ran out.
  */
-static void removeFree(void *wp) 
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
 {
-    if (NEXT_OF(wp) == 0 && PREV_OF(wp) == 0) {
-    	freeBegin = NULL;
-    } else if (NEXT_OF(wp) == 0) {
-    	PUT(NEXT_LINK((size_t*)PREV_OF(wp)), 0);
-    } else if (PREV_OF(wp) == 0)  {
-    	freeBegin = (void*)GET(wp);
-    	PUT(PREV_LINK(freeBegin), 0);
-    } else {
-    	PUT(NEXT_LINK((size_t*)PREV_OF(wp)), NEXT_OF(wp));
-    	PUT(PREV_LINK((size_t*)NEXT_OF(wp)), PREV_OF(wp));
+    size_t asize, i = 0, k, j, csize;
+    arena_t *a;
+    char *bp;
+
+    if (size <= 0 || size > MAX_BLOCK - ALIGNMENT)
+        return 0;
+    if (size >= MM_MMAP_THRESHOLD) {
+        for (; i < n && (out[i] = mapBlock(size)) != NULL; i++)
+            ;
+        return i;
+    }
+    a = arenaGet();
+    LOCK(a);
+#if MM_SLABS
+    if (size <= SLAB_MAX) {
+        for (; i < n && (out[i] = slabAlloc(a, ALIGN(size))) != NULL; i++)
+            ;
+        UNLOCK(a);
+        return i;
     }
+#endif
+    asize = ADJUST(size);
+    while (i < n) {
+        /* one block for as many of them as fit in BATCH_RUN bytes, cut up in place */
+        k = MIN(n - i, BATCH_RUN / asize > 0 ? BATCH_RUN / asize : 1);
+        if ((bp = allocBlock(a, k * asize)) == NULL)
+            break;
+        csize = GET_SIZE(HDRP(bp));
+        PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp)) | 1));
+        for (j = 0; j < k; j++, bp += asize) {
+            if (j > 0)
+                PUT(HDRP(bp), PACK(asize, PREV_ALLOC | 1));
+            out[i + j] = bp;
+        }
+        /* the last one keeps what place could not split off */
+        bp -= asize;
+        PUT(HDRP(bp), PACK(csize - (k - 1) * asize, GET_PREV_ALLOC(HDRP(bp)) | 1));
+        i += k;
+    }
+    UNLOCK(a);
+    return i;
 }
 /*
- * Find best fit for a block with asize bytes 
+ * Free the n blocks in ptrs, which it sorts by address. Blocks of the calling
+ * thread's arena are freed under one lock acquisition, and each run of blocks
+ * that are next to each other in the heap is freed as one block, with one
+ * coalesce and one insertFront.
  */
-static void *find_fit(size_t asize) 
+void mm_free_batch(void **ptrs, size_t n)
 {
-    /* best fit search */
-    char *bp = freeBegin;
-    void *bestBlock = NULL;
-    size_t margin = 1 << 9, best = 1 << 31, diff;
+    arena_t *a, *locked = NULL;
+    size_t i, j, size;
+    char *bp;
 
-    if (bp != NULL) {
-        size_t running = 1;
-        while (running) {
-            if (NEXT_OF(bp) == 0) {
-                running = 0;
-            }
-            if (asize <= GET_SIZE(HDRP(bp))) {
-                diff = GET_SIZE(HDRP(bp)) - asize;
-                if (best > diff) {
-                    best = diff;
-                    bestBlock = bp;
-                }
-                if (diff < margin)
-                    return bp;
-            }
-            bp = (char*)NEXT_OF(bp);
-        } 
+    qsort(ptrs, n, sizeof(*ptrs), ptrCompare);
+    for (i = 0; i < n; i = j) {
+        bp = ptrs[i];
+        j = i + 1;
+        if (bp == NULL)
+            continue;
+        if (IS_MAPPED(bp)) {
+            unmapBlock(bp);
+            continue;
+        }
+        a = ARENA_OF(bp);
+#if NUM_ARENAS > 1
+        if (a != arenaGet()) {
+            remotePush(a, bp);
+            continue;
+        }
+#endif
+        if (a != locked) {
+            if (locked != NULL)
+                UNLOCK(locked);
+            LOCK(a);
+            locked = a;
+        }
+#if MM_SLABS
+        if (IS_SLAB(bp)) {
+            slabFree(a, bp);
+            continue;
+        }
+#endif
+        /* take in the blocks right after it that are freed too */
+        size = GET_SIZE(HDRP(bp));
+        for (; j < n && (char *)ptrs[j] == bp + size && !IS_SLAB_OBJ(ptrs[j]); j++)
+            size += GET_SIZE(HDRP(ptrs[j]));
+        PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)) | 1));
+        freeBlock(a, bp);
     }
-    return bestBlock;
+    if (locked != NULL)
+        UNLOCK(locked);
 }
 /*
- * Place block of asize bytes at start of free block bp 
- * and split if remainder would be at least minimum block size
+ * Start a heap of its own that can grow to max bytes, in a region from
+ * mem_create, for blocks that mm_destroy throws away together. Returns
+ * NULL if all MM_HEAPS of them are in use or memlib has no room.
  */
-static void place(void *bp, size_t asize) 
+mm_heap_t *mm_create(size_t max)
 {
-    size_t csize = GET_SIZE(HDRP(bp));
-    /* remove bp from the freelist */
-    if (!GET_ALLOC(HDRP(bp)))
-        removeFree(bp);
+#if MM_HEAPS
+    arena_t *a;
 
-    if ((csize - asize) >= (OVERHEAD)) { 
-        /* splitting them */
-        PUT(HDRP(bp), PACK(asize, 1));
-        PUT(FTRP(bp), PACK(asize, 1));
-        bp = NEXT_BLKP(bp);
-        PUT(HDRP(bp), PACK(csize-asize, 0));
-        PUT(FTRP(bp), PACK(csize-asize, 0));
-        
-        /* insert bp into freelist */
-        insertFront(bp);
+    BRK_LOCK();
+    for (a = arenas + NUM_ARENAS; a < arenas + ALL_ARENAS && OWN_HEAP(a); a++)
+        ;
+    /* room for the segment to start on a chunk boundary */
+    if (a == arenas + ALL_ARENAS || max > MAX_BLOCK - ARENA_CHUNK ||
+        (a->mem = mem_create(max + ARENA_CHUNK)) == NULL) {
+        BRK_UNLOCK();
+        return NULL;
     }
-    else { 
-        /* not splitting, remainder too small */
-        PUT(HDRP(bp), PACK(csize, 1));
-        PUT(FTRP(bp), PACK(csize, 1));
+    __atomic_store_n(&heapHi, (char *)mem_heap_hi() + 1, __ATOMIC_RELAXED);
+    arenaReset(a);
+    openSegment(a);
+    if (a->heapEnd == 0) {
+        mem_destroy(a->mem);
+        a->mem = NULL;
+        a = NULL;
     }
+    BRK_UNLOCK();
+    return a;
+#else
+    return NULL;
+#endif
 }
 /*
- * Check the heap for consistency 
+ * Throw away the heap and every block in it without looking at them, and
+ * destroy its region. No thread may use the heap or its blocks any more.
  */
-void mm_checkheap(int verbose) 
+void mm_destroy(mm_heap_t *h)
 {
-    char *bp = heapBegin;
-    /* print heap */
-    if (verbose)
-        printf("Heap (%p):\n", heapBegin);
-
-    if ((GET_SIZE(HDRP(heapBegin)) != ALIGNMENT) || !GET_ALLOC(HDRP(heapBegin)))
-        printf("Bad prologue header\n");
-    checkblock(heapBegin);
+#if MM_HEAPS
+    arena_t *a = h;
 
-    for (bp = heapBegin; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        if (verbose) 
-            printblock(bp);
-        if (!GET_ALLOC(HDRP(bp)) && !GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
-            printf("Error: Heap contains contiguous free blocks that somehow escaped coalescing!\n");
-            exit(1);
-        }
-        if (!GET_ALLOC(HDRP(bp))) {
-            if (!contains(bp)) {
-                printf("Error: There exists a free block which is NOT in the freelist!\n");
-                exit(1);
-            }
-        }
-        checkblock(bp);
-    }
-     
-    if (verbose)
-        printblock(bp);
-    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
-        printf("Bad epilogue header\n");
-
-    /* print freelist */
-    if (freeBegin != NULL) {
-        bp = freeBegin;
-        if (verbose) {
-            printf("Free (%p):\n", freeBegin);
-            size_t running = 1;
-            while (running) {
-                if (NEXT_OF(bp) == 0) 
-                    running = 0;
-                /* Is every block in the free list marked as free? */
-                if (GET_ALLOC(HDRP(bp))) {
-                    printf("Error: Allocated block in freelist!\n");
-                    exit(1);
-                }
-                if ((NEXT_OF(bp) != 0 && !contains((void*)NEXT_OF(bp))) || (PREV_OF(bp) != 0 && !contains((void*)PREV_OF(bp)))) {
-                    printf("Error: A link in a free block does not point to a valid free block!");
-                    exit(1);
-                }
-                if (verbose)
-                    printblock(bp);
-                bp = (void*)NEXT_OF(bp);
-            }
-        }
-    }
+    BRK_LOCK();
+    /* every page back in one madvise */
+    arenaShrink(a, arenaBrk(a) - (char *)mem_heap_start(a->mem));
+    /* leave the empty segment a new heap starts with for mm_checkheap to step over,
+       while the region is still ours, then hand it back */
+    arenaReset(a);
+    openSegment(a);
+    mem_destroy(a->mem);
+    a->mem = NULL;
+    BRK_UNLOCK();
+#endif
+}
+/*
+ * Allocate a block of size bytes from the heap h.
+ */
+void *mm_heap_malloc(mm_heap_t *h, size_t size)
+{
+    arena_t *a = h;
+    char *bp;
 
-    
+    if (size <= 0 || size > MAX_BLOCK - ALIGNMENT)
+        return NULL;
+    LOCK(a);
+#if MM_SLABS
+    if (size <= SLAB_MAX)
+        bp = slabAlloc(a, ALIGN(size));
+    else
+#endif
+        bp = allocBlock(a, ADJUST(size));
+    UNLOCK(a);
+    return bp;
 }
 /*
- * Print block
+ * Free a block of the heap h.
  */
-static void printblock(void *bp) 
+void mm_heap_free(mm_heap_t *h, void *ptr)
 {
-    size_t hsize, halloc, fsize, falloc;
+    arena_t *a = h;
 
-    hsize = GET_SIZE(HDRP(bp));
-    halloc = GET_ALLOC(HDRP(bp));
-    fsize = GET_SIZE(FTRP(bp));
-    falloc = GET_ALLOC(FTRP(bp));
-    
-    if (hsize == 0) {
-        printf("%p: EOL\n", bp);
+    if (ptr == NULL)
         return;
-    }
-
-    printf("%p: header: [%d:%c] footer: [%d:%c]\n", bp, 
-           hsize, (halloc ? 'a' : 'f'),
-           fsize, (falloc ? 'a' : 'f')); 
+    LOCK(a);
+    freeAny(a, ptr);
+    UNLOCK(a);
 }
 /*
- * Check if block is obeying the rules
+ * Start a bump arena that takes chunk bytes at a time from mm_malloc and
+ * hands them out with no header per object. The arena itself lives at the
+ * start of its first chunk. Returns NULL if mm_malloc has no room.
  */
-static void checkblock(void *bp) 
+mm_arena_t *mm_arena_create(size_t chunk)
 {
-    if ((size_t)bp % 8) {
-        printf("Error: %p is not doubleword aligned\n", bp);
-        exit(1);
-    }
-    if (GET(HDRP(bp)) != GET(FTRP(bp))) {
-        printf("Error: header does not match footer\n");
-        exit(1);
-    }
+    mm_arena_t *r;
+    char *c;
+
+    if (chunk < BUMP_MIN)
+        chunk = BUMP_MIN;
+    if ((c = mm_malloc(chunk)) == NULL)
+        return NULL;
+    *(char **)c = NULL;
+    r = (mm_arena_t *)(c + BUMP_HEAD);
+    r->next = (char *)r + ALIGN(sizeof(mm_arena_t));
+    r->end = c + mm_usable_size(c);
+    r->chunks = c;
+    r->chunk = chunk;
+    return r;
 }
+/*
+ * Allocate size bytes from the arena r by moving its next pointer up. The
+ * object cannot be freed on its own, only with the rest of the arena.
+ */
+void *mm_arena_alloc(mm_arena_t *r, size_t size)
+{
+    char *bp;
 
+    if (size <= 0 || size > MAX_BLOCK)
+        return NULL;
+    size = ALIGN(size);
+    if (size > (size_t)(r->end - r->next))
+        return bumpChunk(r, size);
+    bp = r->next;
+    r->next += size;
+    return bp;
+}
 /*
- * Check if free block bp is in the freelist
+ * Free every chunk of the arena r but its first and start handing that
+ * one out again from the top. The objects of r are all gone after this.
  */
-size_t contains(void *bp)
+void mm_arena_reset(mm_arena_t *r)
 {
-    void *curr = freeBegin;
-    if (curr != NULL)
-    {
-        size_t running = 1;
-        while (running) {
-            if (NEXT_OF(curr) == 0)
-                running = 0;
-            if (curr == bp)
-                return 1;
-
-            curr = (void*)NEXT_OF(curr);
-        }
+    char *first = (char *)r - BUMP_HEAD;
+    char *c, *prev;
+
+    for (c = r->chunks; c != NULL; c = prev) {
+        prev = *(char **)c;
+        if (c != first)
+            mm_free(c);
+    }
+    *(char **)first = NULL;
+    r->next = (char *)r + ALIGN(sizeof(mm_arena_t));
+    r->end = first + mm_usable_size(first);
+    r->chunks = first;
+}
+/*
+ * Free the arena r and every chunk it has.
+ */
+void mm_arena_destroy(mm_arena_t *r)
+{
+    mm_arena_reset(r);
+    mm_free((char *)r - BUMP_HEAD);
+}
+/*
+ * Take another chunk for an object of size bytes that does not fit in what
+ * is left of the current one. An object of more than a quarter chunk gets a
+ * chunk of its own, so the current one goes on serving the small ones.
+ */
+static void *bumpChunk(mm_arena_t *r, size_t size)
+{
+    int own = size > r->chunk / 4;
+    char *c;
+
+    if ((c = mm_malloc(own ? BUMP_HEAD + size : r->chunk)) == NULL)
+        return NULL;
+    *(char **)c = r->chunks;
+    r->chunks = c;
+    if (own)
+        return c + BUMP_HEAD;
+    r->next = c + BUMP_HEAD + size;
+    r->end = c + mm_usable_size(c);
+    return c + BUMP_HEAD;
+}
+/*
+ * Order pointers by address for qsort
+ */
+static int ptrCompare(const void *x, const void *y)
+{
+    char *p = *(char * const *)x, *q = *(char * const *)y;
+
+    return p < q ? -1 : p > q;
+}
+/*
+ * Allocate a huge block of size bytes in a mapping of its own. memlib is
+ * not thread-safe, so it is only called under brkLock.
+ */
+static void *mapBlock(size_t size)
+{
+    size_t page = mem_pagesize();
+    size_t len = (size + MAP_OVERHEAD + page - 1) / page * page;
+    char *p;
+
+    BRK_LOCK();
+    p = mem_map(len);
+    BRK_UNLOCK();
+    if (p == NULL)
+        return NULL;
+    p += MAP_OVERHEAD;
+    MAP_LEN(p) = len;
+    return p;
+}
+/*
+ * Resize a huge block to size bytes, moving the mapping if it has to.
+ * Returns NULL, leaving the block as it was, if that fails.
+ */
+static void *remapBlock(void *bp, size_t size)
+{
+    size_t page = mem_pagesize();
+    size_t len = (size + MAP_OVERHEAD + page - 1) / page * page;
+    char *p;
+
+    if (len == MAP_LEN(bp))
+        return bp;
+    BRK_LOCK();
+    p = mem_remap((char *)bp - MAP_OVERHEAD, MAP_LEN(bp), len);
+    BRK_UNLOCK();
+    if (p == NULL)
+        return NULL;
+    p += MAP_OVERHEAD;
+    MAP_LEN(p) = len;
+    return p;
+}
+/*
+ * Give a huge block's mapping back.
+ */
+static void unmapBlock(void *bp)
+{
+    BRK_LOCK();
+    mem_unmap((char *)bp - MAP_OVERHEAD, MAP_LEN(bp));
+    BRK_UNLOCK();
+}
+/*
+ * Empty the arena's free lists, slabs and tree, and forget its segments.
+ */
+static void arenaReset(arena_t *a)
+{
+    a->heapEnd = 0;
+    memset(a->slabs, 0, sizeof(a->slabs));
+    memset(a->freeLists, 0, sizeof(a->freeLists));
+    memset(a->slBitmap, 0, sizeof(a->slBitmap));
+    a->flBitmap = 0;
+    a->treeRoot = 0;
+    a->rover = 0;
+    a->decommitted = 0;
+#if MM_QUICK
+    memset(a->quick, 0, sizeof(a->quick));
+    a->quickBytes = 0;
+#endif
+#if MM_THREADS
+    a->remoteFrees = 0;
+    a->remoteCount = 0;
+#endif
+}
+/*
+ * Returns the arena the calling thread allocates from.
+ */
+static arena_t *arenaGet(void)
+{
+#if NUM_ARENAS > 1
+#ifdef MM_ARENA_CPU
+    int cpu = sched_getcpu();
+    if (cpu >= 0)
+        return &arenas[cpu % NUM_ARENAS];
+#endif
+    if (threadArena == 0) {
+        threadArena = __atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % NUM_ARENAS + 1;
+        __atomic_add_fetch(&arenas[threadArena - 1].threads, 1, __ATOMIC_RELAXED);
+        /* registers cacheExit, which drains the arena when the thread exits */
+        cacheGet();
+    }
+    return &arenas[threadArena - 1];
+#else
+    return &arenas[0];
+#endif
+}
+#if NUM_ARENAS > 1
+/*
+ * Hand a block to its arena a without taking a's lock, by pushing it on
+ * a's stack of remote frees. Once REMOTE_MAX blocks are on it, or when no
+ * thread is left to drain them, drain them here if a's lock is free.
+ */
+static void remotePush(arena_t *a, void *bp)
+{
+    unsigned int head = __atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED);
+
+    do {
+        PUT(NEXT_LINK(bp), head);
+    } while (!__atomic_compare_exchange_n(&a->remoteFrees, &head, (char *)bp - heapLo,
+                                          1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if ((__atomic_add_fetch(&a->remoteCount, 1, __ATOMIC_RELAXED) >= REMOTE_MAX || ARENA_IDLE(a)) &&
+        TRYLOCK(a)) {
+        remoteDrain(a);
+        UNLOCK(a);
+    }
+}
+/*
+ * Free every block other threads have pushed on the arena's stack. The
+ * caller holds the arena's lock.
+ */
+static void remoteDrain(arena_t *a)
+{
+    unsigned int link = __atomic_exchange_n(&a->remoteFrees, 0, __ATOMIC_ACQUIRE);
+    char *bp;
+    int n = 0;
+
+    while (link != 0) {
+        bp = heapLo + link;
+        link = GET(NEXT_LINK(bp));
+        freeAny(a, bp);
+        n++;
+    }
+    __atomic_sub_fetch(&a->remoteCount, n, __ATOMIC_RELAXED);
+}
+#endif
+/* 
+ * Allocate a block from the arena's freelists or extend its heap to fit it.
+ * Always allocate a block whose size is a multiple of the alignment.
+ * The caller holds the arena's lock.
+ */
+static void *allocBlock(arena_t *a, size_t asize)
+{
+    char *bp;      
+
+#if NUM_ARENAS > 1
+    /* take back what other threads freed first, it may fit */
+    if (__atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED) != 0)
+        remoteDrain(a);
+#endif
+#if MM_QUICK
+    if ((bp = quickAlloc(a, asize)) != NULL)
+        return bp;
+#endif
+    /* Search the free list for a fit */
+    if ((bp = find_fit(a, asize)) != NULL)
+        return placeFit(a, bp, asize);
+#if MM_QUICK
+    /* coalesce what the quick lists hold before growing the heap */
+    if (quickMerge(a) && (bp = find_fit(a, asize)) != NULL)
+        return placeFit(a, bp, asize);
+#endif
+    /* No fit found. Get more memory and place the block */
+    if ((bp = extendHeap(a, asize, NULL)) == NULL)
+        return NULL;
+
+    place(a, bp, asize);
+
+    return bp;
+}
+/*
+ * Allocate a block like allocBlock does for mm_calloc, and set *dirty to how
+ * many of the first size bytes of its payload the caller has to zero. That
+ * is all of them for a block off the free lists. A block extendHeap made is
+ * zero from where memlib's clean memory starts, but for the links and footer
+ * it had as a free block, which are cleared here. The caller holds the
+ * arena's lock.
+ */
+static void *callocBlock(arena_t *a, size_t asize, size_t size, size_t *dirty)
+{
+    char *bp, *end = GET_LINK(&a->heapEnd), *clean;
+
+#if NUM_ARENAS > 1
+    if (__atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED) != 0)
+        remoteDrain(a);
+#endif
+#if MM_QUICK
+    if ((bp = quickAlloc(a, asize)) != NULL) {
+        *dirty = size;
+        return bp;
+    }
+    /* coalesce what the quick lists hold before growing the heap */
+    if ((bp = find_fit(a, asize)) == NULL && quickMerge(a))
+        bp = find_fit(a, asize);
+#else
+    bp = find_fit(a, asize);
+#endif
+    if (bp != NULL) {
+        place(a, bp, asize);
+        *dirty = size;
+        return bp;
+    }
+    if ((bp = extendHeap(a, asize, &clean)) == NULL)
+        return NULL;
+    place(a, bp, asize);
+
+    *dirty = clean > bp ? MIN((size_t)(clean - bp), size) : 0;
+    PUT(NEXT_LINK(bp), 0);
+    PUT(PREV_LINK(bp), 0);
+    /* the new memory starts at the old epilogue if it merged with a free block */
+    if (end > bp && end < bp + size) {
+        PUT(NEXT_LINK(end), 0);
+        PUT(PREV_LINK(end), 0);
+    }
+    if (FTRP(bp) < bp + size)
+        PUT(FTRP(bp), 0);
+    return bp;
+}
+/*
+ * Allocate a block of asize bytes whose payload starts on an align boundary.
+ * heapLo is page aligned, so up to a page that is also counted from heapLo.
+ * The free space cut off in front of it goes back to the free lists. The
+ * caller holds the arena's lock.
+ */
+static void *allocAligned(arena_t *a, size_t asize, size_t align)
+{
+    size_t need = asize + align + 2 * OVERHEAD, csize, gap;
+    char *bp;
+
+    /* the best fit for asize may have room for an aligned payload already */
+    if ((bp = find_fit(a, asize)) == NULL || !alignFits(bp, asize, align))
+        if ((bp = find_fit(a, need)) == NULL &&
+#if MM_QUICK
+            (!quickMerge(a) || (bp = find_fit(a, need)) == NULL) &&
+#endif
+            (bp = extendHeap(a, need, NULL)) == NULL)
+            return NULL;
+
+    if ((gap = alignGap(bp, align)) != 0) {
+        /* split off the front as a free block of its own */
+        csize = GET_SIZE(HDRP(bp));
+        removeFree(a, bp);
+        PUT(HDRP(bp), PACK(gap, GET_PREV_ALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(gap, 0));
+        insertFront(a, bp);
+        bp += gap;
+        PUT(HDRP(bp), PACK(csize - gap, 0));
+        PUT(FTRP(bp), PACK(csize - gap, 0));
+        insertFront(a, bp);
+    }
+    place(a, bp, asize);
+    return bp;
+}
+/*
+ * Can the free block bp hold an aligned payload of asize bytes, with the
+ * space after it either none or a block of its own? A few bytes place could
+ * not split off would make the block larger than asize, which a slab must
+ * not be.
+ */
+static int alignFits(void *bp, size_t asize, size_t align)
+{
+    size_t csize = GET_SIZE(HDRP(bp)), gap = alignGap(bp, align);
+
+    return gap + asize == csize || gap + asize + OVERHEAD <= csize;
+}
+/*
+ * Returns how far the payload of bp has to move up to start on an align
+ * boundary, leaving room for a free block in front of it.
+ */
+static size_t alignGap(void *bp, size_t align)
+{
+    size_t gap = (align - (size_t)bp % align) % align;
+
+    if (gap != 0 && gap < OVERHEAD)
+        gap += align;
+    return gap;
+}
+/*
+ * Free a slab object or a heap block. The caller holds the lock of the arena
+ * a that owns it.
+ */
+static void freeAny(arena_t *a, void *ptr)
+{
+#if MM_SLABS
+    if (IS_SLAB(ptr)) {
+        slabFree(a, ptr);
+        return;
+    }
+#endif
+#if MM_QUICK
+    if (quickFree(a, ptr))
+        return;
+#endif
+    freeBlock(a, ptr);
+}
+#if MM_QUICK
+/*
+ * Push the allocated block bp onto the quick list of its size if it is small
+ * enough and neither of its neighbours is free, without coalescing it. It
+ * stays allocated as far as the heap is concerned. Once the lists hold more
+ * than QUICK_BYTES they are merged. Returns whether it took the block. The
+ * caller holds the lock of arena a.
+ */
+static int quickFree(arena_t *a, void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+
+    if (size > QUICK_MAX || !GET_PREV_ALLOC(HDRP(bp)) || !GET_ALLOC(HDRP(NEXT_BLKP(bp))) ||
+        (policy & MM_FREE_LISTS_ONLY))
+        return 0;
+    PUT(NEXT_LINK(bp), a->quick[size / ALIGNMENT]);
+    PUT_LINK(&a->quick[size / ALIGNMENT], bp);
+    a->quickBytes += size;
+    if (a->quickBytes > QUICK_BYTES)
+        quickMerge(a);
+    return 1;
+}
+/*
+ * Pop a block of exactly asize bytes off its quick list, or return NULL if
+ * there is none. The caller holds the lock of arena a.
+ */
+static void *quickAlloc(arena_t *a, size_t asize)
+{
+    char *bp;
+
+    if (asize > QUICK_MAX || (bp = GET_LINK(&a->quick[asize / ALIGNMENT])) == NULL)
+        return NULL;
+    PUT(&a->quick[asize / ALIGNMENT], GET(NEXT_LINK(bp)));
+    a->quickBytes -= asize;
+    /* a block mm_realloc grew once is a new block now */
+    PUT(HDRP(bp), GET(HDRP(bp)) & ~REALLOCED);
+    return bp;
+}
+/*
+ * Free every block on the arena's quick lists for real, coalescing them in
+ * one sweep, so each is trimmed or decommitted with its neighbours as a free
+ * would. Returns whether there were any. The caller holds the lock of
+ * arena a.
+ */
+static int quickMerge(arena_t *a)
+{
+    char *bp;
+    int i;
+
+    if (a->quickBytes == 0)
+        return 0;
+    a->quickBytes = 0;      /* freeBlock below must not merge again */
+    for (i = 0; i < QUICK_BINS; i++) {
+        while ((bp = GET_LINK(&a->quick[i])) != NULL) {
+            PUT(&a->quick[i], GET(NEXT_LINK(bp)));
+            freeBlock(a, bp);
+        }
+    }
+    return 1;
+}
+#endif
+/*
+ * Freeing a block does everything. The caller holds the lock of the arena a
+ * that owns it.
+ */
+static void freeBlock(arena_t *a, void *ptr)
+{
+    size_t size = GET_SIZE(HDRP(ptr));
+    PUT(HDRP(ptr), PACK(size, GET_PREV_ALLOC(HDRP(ptr))));
+    PUT(FTRP(ptr), PACK(size, 0));
+    CLR_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)));
+    ptr = coalesce(a, ptr);
+    /* Jess ég er frír! */
+    if (GET_SIZE(HDRP(ptr)) >= MM_TRIM_THRESHOLD && NEXT_BLKP(ptr) == GET_LINK(&a->heapEnd) && trimHeap(a, ptr))
+        return;
+    if (GET_SIZE(HDRP(ptr)) >= MM_DECOMMIT_THRESHOLD)
+        decommitBlock(a, ptr);
+#if MM_QUICK
+    /* quick blocks next to a large block or the top may keep them from being trimmed */
+    if (GET_SIZE(HDRP(ptr)) >= MM_TRIM_THRESHOLD || NEXT_BLKP(ptr) == GET_LINK(&a->heapEnd))
+        quickMerge(a);
+#endif
+}
+/*
+ * Give all but TRIM_PAD bytes of the free block bp at the end of the arena's
+ * last segment back to memlib, if that segment ends at the arena's brk. Returns
+ * whether it did. The caller holds the arena's lock.
+ */
+static int trimHeap(arena_t *a, void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp)) - TRIM_PAD;
+    int trimmed = 0;
+
+    BRK_LOCK();
+    if (GET_LINK(&a->heapEnd) == arenaBrk(a)) {
+        removeFree(a, bp);
+        PUT(HDRP(bp), PACK(TRIM_PAD, GET_PREV_ALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(TRIM_PAD, 0));
+        insertFront(a, bp);
+        PUT_LINK(&a->heapEnd, NEXT_BLKP(bp));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));   /* new epilogue header */
+        arenaShrink(a, size);
+        if (!OWN_HEAP(a))
+            __atomic_store_n(&heapHi, NEXT_BLKP(bp), __ATOMIC_RELAXED);
+        trimmed = 1;
+    }
+    BRK_UNLOCK();
+    return trimmed;
+}
+/*
+ * Give the physical memory of the free block's interior back and mark it
+ * decommitted. The caller holds the arena's lock.
+ */
+static void decommitBlock(arena_t *a, void *bp)
+{
+    char *lo;
+    size_t size = interior(bp, &lo);
+
+    if (size == 0 || GET_DECOMMITTED(HDRP(bp)))
+        return;
+    mem_decommit(lo, size);
+    PUT(HDRP(bp), GET(HDRP(bp)) | DECOMMITTED);
+    a->decommitted += size;
+}
+/*
+ * Returns the size of the free block's interior, the whole pages after its
+ * links and before its footer, and its start in lo.
+ */
+static size_t interior(void *bp, char **lo)
+{
+    char *hi = PAGE_DOWN(FTRP(bp));
+
+    *lo = PAGE_UP((char *)bp + DSIZE);
+    return *lo < hi ? (size_t)(hi - *lo) : 0;
+}
+/*
+ * Returns the bytes of address space the allocator holds, the heap up to
+ * the brk and the mappings of huge blocks.
+ */
+size_t mm_reserved(void)
+{
+    size_t size;
+
+    BRK_LOCK();
+    size = mem_heapsize() + mem_mapsize();
+    BRK_UNLOCK();
+    return size;
+}
+/*
+ * Returns mm_reserved less the bytes given back by decommitted free blocks.
+ */
+size_t mm_committed(void)
+{
+    size_t size = mm_reserved();
+    arena_t *a;
+
+    for (a = arenas; a < arenas + ALL_ARENAS; a++) {
+        LOCK(a);
+        size -= a->decommitted;
+        UNLOCK(a);
+    }
+    return size;
+}
+/*
+ * Reallocates the block to it's new size and returns a pointer to the block.
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+    arena_t *a;
+
+    if (size == 0) {
+        mm_free(ptr);
+        return ptr;
+    }
+    if (ptr == NULL) {
+        if ((ptr = mm_malloc(size)) == NULL) {
+            printf("ERROR: mm_malloc failed in mm_realloc\n");
+            exit(1);
+        } else
+            return ptr;
+    }
+    if (size > MAX_BLOCK - ALIGNMENT)
+        return NULL;
+    if (IS_MAPPED(ptr)) {
+        void *nptr;
+
+        if (size >= MM_MMAP_THRESHOLD)
+            return remapBlock(ptr, size);
+        /* small enough for the heap again */
+        if ((nptr = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(nptr, ptr, size);
+        unmapBlock(ptr);
+        return nptr;
+    }
+#if MM_SLABS
+    if (IS_SLAB(ptr)) {
+        /* objects do not change size, move it unless it is large enough already */
+        size_t osize = SLAB_OF(ptr)->size;
+        void *nptr;
+
+        if (size <= osize)
+            return ptr;
+        /* a block of an mm_create heap stays in it */
+        a = ARENA_OF(ptr);
+        if (OWN_HEAP(a)) {
+            if ((nptr = mm_heap_malloc(a, size)) == NULL)
+                return NULL;
+            blockMove(nptr, ptr, osize);
+            mm_heap_free(a, ptr);
+            return nptr;
+        }
+        if ((nptr = mm_malloc(size)) == NULL)
+            return NULL;
+        blockMove(nptr, ptr, osize);
+        mm_free(ptr);
+        return nptr;
+    }
+#endif
+    /* a block of an mm_create heap grows within its region instead */
+    if (size >= MM_MMAP_THRESHOLD && !OWN_HEAP(ARENA_OF(ptr))) {
+        /* the block outgrew the heap, move it to a mapping of its own unless it can grow where it is */
+        void *nptr;
+        int grown;
+
+        a = ARENA_OF(ptr);
+        LOCK(a);
+        if ((grown = ADJUST(size) <= GET_SIZE(HDRP(ptr))))
+            shrinkBlock(a, ptr, ADJUST(size));
+        else
+            grown = growBlock(a, ptr, ADJUST(size), ADJUST(size), 1);
+        UNLOCK(a);
+        if (grown)
+            return ptr;
+        if ((nptr = mapBlock(size)) == NULL)
+            return NULL;
+        blockMove(nptr, ptr, GET_SIZE_UNLOCKED(HDRP(ptr)) - ALLOC_OVERHEAD);
+        mm_free(ptr);
+        return nptr;
+    }
+
+    a = ARENA_OF(ptr);
+    LOCK(a);
+    ptr = reallocBlock(a, ptr, size);
+    UNLOCK(a);
+    return ptr;
+}
+/*
+ * Does the work of mm_realloc for a block and a size it has checked.
+ * The block stays in its arena a, whose lock the caller holds.
+ */
+static void *reallocBlock(arena_t *a, void *ptr, size_t size)
+{
+    size_t oldSize = GET_SIZE(HDRP(ptr));
+    size_t newSize = ADJUST(size);
+    size_t want = newSize, prevSize;
+    void *nextp = NEXT_BLKP(ptr), *prevp, *nptr;
+
+    if (newSize <= oldSize) {
+        shrinkBlock(a, ptr, newSize);
+        return ptr;
+    }
+    /* a block that grows again is likely to keep growing, leave it room */
+    if (GET_REALLOCED(HDRP(ptr)) && newSize + REALLOC_ROOM(newSize) < MM_MMAP_THRESHOLD)
+        want = ALIGN(newSize + REALLOC_ROOM(newSize));
+
+    if (growBlock(a, ptr, newSize, want, 0))
+        return ptr;
+
+    /* the block before can only be read through its footer, which it only has if free */
+    if (!GET_PREV_ALLOC(HDRP(ptr))) {
+        size_t nextSize = GET_ALLOC(HDRP(nextp)) ? 0 : GET_SIZE(HDRP(nextp));
+
+        prevp = PREV_BLKP(ptr);
+        prevSize = GET_SIZE(HDRP(prevp));
+        if (prevSize + oldSize + nextSize >= newSize) {
+            /* take in the block after too, so no free block is left next to a split */
+            removeFree(a, prevp);
+            if (nextSize != 0)
+                removeFree(a, nextp);
+            PUT(HDRP(prevp), PACK(prevSize + oldSize + nextSize, GET_PREV_ALLOC(HDRP(prevp)) | 1));
+            blockMove(prevp, ptr, oldSize - ALLOC_OVERHEAD);
+            place(a, prevp, MIN(want, prevSize + oldSize + nextSize));
+            PUT(HDRP(prevp), GET(HDRP(prevp)) | REALLOCED);
+            return prevp;
+        }
+    }
+
+    /* move it to a free block that fits, as mm_malloc would */
+    if ((nptr = find_fit(a, want)) != NULL)
+        place(a, nptr, want);
+    /* otherwise the heap has to grow anyway, under the block if it ends the heap */
+    else if (growBlock(a, ptr, newSize, want, 1))
+        return ptr;
+    else if ((nptr = allocBlock(a, want)) == NULL) {
+        printf("ERROR: mm_malloc failed in mm_realloc\n");
+        exit(1);
+    }
+    blockMove(nptr, ptr, oldSize - ALLOC_OVERHEAD);
+    PUT(HDRP(nptr), GET(HDRP(nptr)) | REALLOCED);
+    freeBlock(a, ptr);
+    return nptr;
+}
+/*
+ * Grow the allocated block bp in place to at least newSize and at most want
+ * bytes, into the free block after it or, if extend is set and the block
+ * ends the heap, by extending the heap. Returns whether it could. The caller
+ * holds the lock of the arena a.
+ */
+static int growBlock(arena_t *a, void *bp, size_t newSize, size_t want, int extend)
+{
+    size_t oldSize = GET_SIZE(HDRP(bp)), nextSize = 0;
+    void *nextp = NEXT_BLKP(bp);
+
+    if (!GET_ALLOC(HDRP(nextp)))
+        nextSize = GET_SIZE(HDRP(nextp));
+    if (oldSize + nextSize < newSize) {
+        if (!extend || (char *)nextp + nextSize != GET_LINK(&a->heapEnd) || extendHeap(a, want - oldSize, NULL) != nextp)
+            return 0;
+        nextSize = GET_SIZE(HDRP(nextp));
+    }
+    removeFree(a, nextp);
+    PUT(HDRP(bp), PACK(oldSize + nextSize, GET_PREV_ALLOC(HDRP(bp)) | 1));
+    place(a, bp, MIN(want, oldSize + nextSize));
+    PUT(HDRP(bp), GET(HDRP(bp)) | REALLOCED);
+    return 1;
+}
+/*
+ * Cut the allocated block bp down to asize bytes. The tail is freed like any
+ * other block, so it merges with a free block after it. The caller holds the
+ * lock of the arena a.
+ */
+static void shrinkBlock(arena_t *a, void *bp, size_t asize)
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+
+    if (csize - asize < OVERHEAD)
+        return;
+    PUT(HDRP(bp), PACK(asize, GET(HDRP(bp)) & (PREV_ALLOC | REALLOCED | 1)));
+    bp = NEXT_BLKP(bp);
+    PUT(HDRP(bp), PACK(csize - asize, PREV_ALLOC | 1));
+    freeBlock(a, bp);
+}
+/*
+ * Move the n byte payload at src to dst. The two may overlap when a block
+ * slides down into the free block before it, and may be the same.
+ */
+static void blockMove(void *dst, const void *src, size_t n)
+{
+    if (dst != src)
+        memmove(dst, src, n);
+}
+#if MM_THREADS
+/*
+ * Returns the calling thread's cache, emptied if it holds blocks of a heap
+ * that mm_init has since replaced.
+ */
+static tcache_t *cacheGet(void)
+{
+    tcache_t *tc = &tcache;
+    unsigned int generation = __atomic_load_n(&heapGeneration, __ATOMIC_ACQUIRE);
+
+    if (tc->generation != generation) {
+        memset(tc->bins, 0, sizeof(tc->bins));
+        memset(tc->counts, 0, sizeof(tc->counts));
+        tc->generation = generation;
+    }
+    if (!tc->registered) {
+        /* have cacheExit flush the cache when the thread exits */
+        pthread_once(&tcacheOnce, cacheKeyInit);
+        pthread_setspecific(tcacheKey, tc);
+        tc->registered = 1;
+    }
+    return tc;
+}
+/*
+ * Allocate an object of size bytes (a block of size bytes when there are no
+ * slabs) from the thread's cache. An empty bin is refilled with TCACHE_BATCH
+ * of them from the thread's arena under one lock.
+ */
+static void *cacheMalloc(size_t size)
+{
+    tcache_t *tc = cacheGet();
+    int bin = size / ALIGNMENT, n;
+    char *bp, *extra;
+    arena_t *a;
+
+    if ((bp = tc->bins[bin]) != NULL) {
+        tc->bins[bin] = NEXT_OF(bp);
+        tc->counts[bin]--;
+        return bp;
+    }
+
+    a = arenaGet();
+    LOCK(a);
+#if MM_SLABS
+#define CACHE_ALLOC(a, size) slabAlloc(a, size)
+#else
+#define CACHE_ALLOC(a, size) allocBlock(a, size)
+#endif
+    bp = CACHE_ALLOC(a, size);
+    for (n = 1; bp != NULL && n < TCACHE_BATCH; n++) {
+        if ((extra = CACHE_ALLOC(a, size)) == NULL)
+            break;
+        PUT_LINK(NEXT_LINK(extra), tc->bins[bin]);
+        tc->bins[bin] = extra;
+        tc->counts[bin]++;
+    }
+    UNLOCK(a);
+    return bp;
+}
+/*
+ * Put a slab object (a small block when there are no slabs) in the thread's
+ * cache, flushing TCACHE_BATCH of its bin back first if the bin is full.
+ * Returns 0 if ptr cannot be cached.
+ */
+static int cacheFree(void *ptr)
+{
+    size_t size;
+    int bin;
+    tcache_t *tc;
+
+#if MM_SLABS
+    if (!IS_SLAB(ptr))
+        return 0;
+    size = SLAB_OF(ptr)->size;
+#else
+    size = GET_SIZE_UNLOCKED(HDRP(ptr));
+    if (size > TCACHE_MAX || (policy & MM_FREE_LISTS_ONLY))
+        return 0;
+#endif
+    /* a block of an mm_create heap must not outlive mm_destroy in a cache */
+    if (OWN_HEAP(ARENA_OF(ptr)))
+        return 0;
+    bin = size / ALIGNMENT;
+    tc = cacheGet();
+    if (tc->counts[bin] >= TCACHE_COUNT)
+        cacheFlush(tc, bin, TCACHE_COUNT - TCACHE_BATCH);
+    PUT_LINK(NEXT_LINK(ptr), tc->bins[bin]);
+    tc->bins[bin] = ptr;
+    tc->counts[bin]++;
+    return 1;
+}
+/*
+ * Free blocks of the bin back to their arenas until keep are left. Blocks
+ * of the thread's own arena are freed under one lock, the others are pushed
+ * on their arena's remote frees.
+ */
+static void cacheFlush(tcache_t *tc, int bin, int keep)
+{
+    arena_t *own = arenaGet(), *locked = NULL;
+    char *bp;
+
+    while (tc->counts[bin] > keep) {
+        bp = tc->bins[bin];
+        tc->bins[bin] = NEXT_OF(bp);
+        tc->counts[bin]--;
+#if NUM_ARENAS > 1
+        if (ARENA_OF(bp) != own) {
+            remotePush(ARENA_OF(bp), bp);
+            continue;
+        }
+#endif
+        if (locked == NULL) {
+            LOCK(own);
+            locked = own;
+        }
+        freeAny(own, bp);
+    }
+    if (locked != NULL)
+        UNLOCK(locked);
+}
+/*
+ * Thread exit destructor, returns the thread's cached blocks to the heap
+ * and frees what other threads pushed on its arena's remote frees.
+ */
+static void cacheExit(void *arg)
+{
+    tcache_t *tc = arg;
+    int bin;
+#if NUM_ARENAS > 1
+    arena_t *a;
+#endif
+
+    if (tc->generation == __atomic_load_n(&heapGeneration, __ATOMIC_ACQUIRE)) {
+        for (bin = 0; bin < TCACHE_BINS; bin++)
+            cacheFlush(tc, bin, 0);
+#if NUM_ARENAS > 1
+        a = arenaGet();
+        LOCK(a);
+        remoteDrain(a);
+        UNLOCK(a);
+#endif
+    }
+#if NUM_ARENAS > 1
+    if (threadArena != 0)
+        __atomic_sub_fetch(&arenas[threadArena - 1].threads, 1, __ATOMIC_RELAXED);
+#endif
+}
+static void cacheKeyInit(void)
+{
+    pthread_key_create(&tcacheKey, cacheExit);
+}
+#endif
+#if MM_SHARED
+/*
+ * Fork child handler. The child shares the heap but not the parent's
+ * tcache, whose blocks the parent still hands out, so it forgets them, and
+ * it picks an arena of its own.
+ */
+static void forkChild(void)
+{
+    memset(tcache.bins, 0, sizeof(tcache.bins));
+    memset(tcache.counts, 0, sizeof(tcache.counts));
+#if NUM_ARENAS > 1
+    threadArena = 0;
+#endif
+}
+static void forkInit(void)
+{
+    pthread_atfork(NULL, NULL, forkChild);
+}
+#endif
+#if MM_SLABS
+/*
+ * Allocate an object of size bytes from the first slab of that size with a
+ * free object, or from a new slab. The caller holds the arena's lock.
+ */
+static void *slabAlloc(arena_t *a, size_t size)
+{
+    slab_t *s;
+    int w, i;
+
+#if NUM_ARENAS > 1
+    if (__atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED) != 0)
+        remoteDrain(a);
+#endif
+    if (a->slabs[size / ALIGNMENT] != 0)
+        s = (slab_t *)GET_LINK(&a->slabs[size / ALIGNMENT]);
+    else if ((s = slabNew(a, size)) == NULL)
+        return NULL;
+
+    for (w = 0; s->used[w] == ~0ULL; w++)
+        ;
+    i = __builtin_ctzll(~s->used[w]);
+    s->used[w] |= 1ULL << i;
+    if (--s->free == 0)
+        slabUnlink(a, s);
+    return (char *)(s + 1) + (w * 64 + i) * s->size;
+}
+/*
+ * Free an object. A slab that was full goes back on its list, and one that
+ * is now empty is freed to the heap unless it is the only slab of its size.
+ * The caller holds the arena's lock.
+ */
+static void slabFree(arena_t *a, void *ptr)
+{
+    slab_t *s = SLAB_OF(ptr);
+    int i = ((char *)ptr - (char *)(s + 1)) / s->size;
+
+    s->used[i / 64] &= ~(1ULL << (i % 64));
+    if (s->free++ == 0) {
+        /* put it at the front of its list */
+        s->prev = 0;
+        s->next = a->slabs[s->size / ALIGNMENT];
+        if (s->next != 0)
+            PUT_LINK(&((slab_t *)GET_LINK(&s->next))->prev, s);
+        PUT_LINK(&a->slabs[s->size / ALIGNMENT], s);
+    } else if (s->free == s->count && (s->next != 0 || s->prev != 0)) {
+        slabUnlink(a, s);
+        CLR_SLAB(s);
+        freeBlock(a, s);
+    }
+}
+/*
+ * Carve a new slab for objects of size bytes out of the heap and put it on
+ * its list. Returns NULL if the heap is out of memory.
+ */
+static slab_t *slabNew(arena_t *a, size_t size)
+{
+    slab_t *s;
+    int i;
+
+    if ((s = allocAligned(a, SLAB_SIZE, SLAB_SIZE)) == NULL)
+        return NULL;
+    s->size = size;
+    s->count = SLAB_OBJS / size;
+    s->free = s->count;
+    /* the bits past the last object are never free */
+    memset(s->used, 0, sizeof(s->used));
+    for (i = s->count; i < SLAB_WORDS * 64; i++)
+        s->used[i / 64] |= 1ULL << (i % 64);
+    s->prev = 0;
+    s->next = 0;
+    PUT_LINK(&a->slabs[size / ALIGNMENT], s);
+    SET_SLAB(s);
+    return s;
+}
+/*
+ * Takes the slab off its list.
+ */
+static void slabUnlink(arena_t *a, slab_t *s)
+{
+    if (s->prev == 0)
+        a->slabs[s->size / ALIGNMENT] = s->next;
+    else
+        ((slab_t *)GET_LINK(&s->prev))->next = s->next;
+    if (s->next != 0)
+        ((slab_t *)GET_LINK(&s->next))->prev = s->prev;
+    s->next = 0;
+    s->prev = 0;
+}
+#endif
+/*
+ * Extend the arena's heap so that it ends with a free block of at least asize
+ * bytes and return that block. The last segment grows in place if it ends at
+ * the brk, otherwise the arena gets a new segment. If clean is not NULL it is
+ * set to memlib's clean mark as it was under the same brkLock, before the heap
+ * grew, everything in the block from there up reads as zero.
+ */ 
+static void *extendHeap(arena_t *a, size_t asize, char **clean) 
+{
+    char *bp, *end;
+    size_t size = asize;
+
+    BRK_LOCK();
+    if ((end = GET_LINK(&a->heapEnd)) != arenaBrk(a)) {
+        openSegment(a);
+        if ((end = GET_LINK(&a->heapEnd)) == NULL) {
+            BRK_UNLOCK();
+            return NULL;
+        }
+    }
+    if (clean != NULL)
+        *clean = mem_heap_clean();
+    /* last block is free, so extend heap just enough to be able to insert the new block */
+    if (!GET_PREV_ALLOC(HDRP(end))) {
+        bp = PREV_BLKP(end);
+        /* a search that stops after FIT_SCAN blocks can miss it when it fits already */
+        if (GET_SIZE(HDRP(bp)) >= asize) {
+            BRK_UNLOCK();
+            return bp;
+        }
+        size -= GET_SIZE(HDRP(bp));
+    }
+    /* grow by whole chunks when arenas take turns at the brk */
+    if (ARENAS_SHARED() && !OWN_HEAP(a) && size < ARENA_CHUNK)
+        size = ARENA_CHUNK;
+    if ((bp = arenaSbrk(a, size)) == (void *)-1) {
+        BRK_UNLOCK();
+        return NULL;
+    }
+    mapChunks(a, bp, bp + size);
+    if (!OWN_HEAP(a))
+        __atomic_store_n(&heapHi, bp + size, __ATOMIC_RELAXED);
+    BRK_UNLOCK();
+
+    /* Initialize free block header/footer and the epilogue header */
+    PUT(NEXT_LINK(bp), 0);                      /* nextlink points to NULL */
+    PUT(PREV_LINK(bp), 0);                      /* prevlink points to NULL */
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)))); /* free block header over the old epilogue */
+    PUT(FTRP(bp), PACK(size, 0));               /* free block footer */
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));       /* new epilogue header */
+    PUT_LINK(&a->heapEnd, NEXT_BLKP(bp));       /* put heapEnd to where it's supposed to be */
+
+    /* Coalesce if the previous block was free */
+    return coalesce(a, bp);
+}
+/*
+ * Start a new empty segment for the arena at the first chunk boundary at or
+ * above its brk, which is its region's for an mm_create heap. Leaves heapEnd
+ * 0 if memlib is out of memory. The caller holds brkLock, or is mm_init.
+ */
+static void openSegment(arena_t *a)
+{
+    char *brk = arenaBrk(a);
+    char *seg = heapLo + CHUNK_UP(brk);
+
+    if (arenaSbrk(a, seg - brk + 4 * WORD) == (void *)-1) {
+        a->heapEnd = 0;
+        return;
+    }
+    PUT(seg, 0);                                     /* Create padding */
+#if MM_HEAPS
+    if (OWN_HEAP(a))
+        PUT_LINK(seg, mem_heap_end(a->mem));         /* the region ends there, not at the epilogue */
+#endif
+    PUT(seg + WORD, PACK(DSIZE, PREV_ALLOC | 1));    /* Create prologue header */
+    PUT(seg + DSIZE, PACK(DSIZE, PREV_ALLOC | 1));   /* Create prologue footer */
+    PUT(seg + DSIZE + WORD, PACK(0, PREV_ALLOC | 1)); /* Create epilogue header */
+    PUT_LINK(&a->heapEnd, seg + 4 * WORD);
+    mapChunks(a, seg, seg + 4 * WORD);
+    if (!OWN_HEAP(a))
+        __atomic_store_n(&heapHi, seg + 4 * WORD, __ATOMIC_RELAXED);
+}
+/*
+ * Record a as the owner of the chunks that [lo, hi), memory just taken from
+ * memlib, lies in, and forget the slabs an earlier heap had there.
+ */
+static void mapChunks(arena_t *a, char *lo, char *hi)
+{
+#if ALL_ARENAS > 1
+    size_t chunk;
+
+    for (chunk = (lo - heapLo) >> CHUNK_LOG; chunk <= (size_t)(hi - 1 - heapLo) >> CHUNK_LOG; chunk++)
+        arenaMap[chunk] = a - arenas;
+#endif
+#if MM_SLABS
+    for (; lo < hi; lo += SLAB_SIZE)
+        CLR_SLAB(lo);
+    CLR_SLAB(hi - 1);
+#endif
+}
+/*
+ * Returns the brk the arena's heap grows at, the end of the memlib heap
+ * for the threads' arenas and the brk of its region for an mm_create heap.
+ */
+static char *arenaBrk(arena_t *a)
+{
+#if MM_HEAPS
+    if (OWN_HEAP(a))
+        return mem_heap_brk(a->mem);
+#endif
+    return (char *)mem_heap_hi() + 1;
+}
+/*
+ * Grow the arena's brk by incr bytes, see arenaBrk, and return the old brk.
+ * Growing never shrinks, an incr of 0 or of more than memlib's heap can hold
+ * fails with (void *)-1. Only arenaShrink moves the brk down. The caller
+ * holds brkLock.
+ */
+static void *arenaSbrk(arena_t *a, size_t incr)
+{
+    if (incr == 0 || incr > mem_maxsize())
+        return (void *)-1;
+#if MM_HEAPS
+    if (OWN_HEAP(a))
+        return mem_heap_sbrk(a->mem, (int)incr);
+#endif
+    return mem_sbrk((int)incr);
+}
+/*
+ * Move the arena's brk down by decr bytes the caller has taken out of its
+ * heap. The caller holds brkLock.
+ */
+static void arenaShrink(arena_t *a, size_t decr)
+{
+#if MM_HEAPS
+    if (OWN_HEAP(a)) {
+        mem_heap_sbrk(a->mem, -(int)decr);
+        return;
+    }
+#endif
+    mem_sbrk(-(int)decr);
+}
+/*
+ * Boundary tag coalescing. Return ptr to coalesced block
+ */ 
+static void *coalesce(arena_t *a, void *bp) 
+{
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    size_t size = GET_SIZE(HDRP(bp));
+    void *wp = bp;
+
+    if (prev_alloc && !next_alloc) {           /* Coalesce with block to the right */
+        wp = NEXT_BLKP(bp);
+        size += GET_SIZE(HDRP(wp));
+        removeFree(a, wp);
+    }
+    else if (!prev_alloc && next_alloc) {      /* Coalesce with block to the left */
+     	wp = PREV_BLKP(bp);
+        size += GET_SIZE(HDRP(wp));
+        removeFree(a, wp);
+        bp = wp;
+    }
+    else if (!prev_alloc && !next_alloc) {      /* Coalesce with both blocks  */
+        wp = NEXT_BLKP(bp);
+        size += GET_SIZE(HDRP(wp));
+        removeFree(a, wp);
+        wp = PREV_BLKP(bp);
+        size += GET_SIZE(HDRP(wp));
+        removeFree(a, wp);
+    	bp = wp;
+    }
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+    PUT(FTRP(bp), PACK(size, 0));
+
+    insertFront(a, bp);
+
+    return bp;
+}
+/*
+ * Returns the index of the free list that holds blocks of the given size.
+ * The first level is the power of two below size and the second level is
+ * given by the SL_LOG bits that follow the leading one.
+ */
+static int sizeClass(size_t size)
+{
+    int fl, sl, log;
+
+    if (size < SMALL_BLOCK) {
+        fl = 0;
+        sl = size >> ALIGN_LOG;
+    } else {
+        log = 31 - __builtin_clz((unsigned int)size);
+        fl = log - FL_SHIFT + 1;
+        sl = (size >> (log - SL_LOG)) - SL_COUNT;
+    }
+    return fl * SL_COUNT + sl;
+}
+/*
+ * Returns the first non-empty class at or above class, or -1 if there is none.
+ */
+static int nextClass(arena_t *a, int class)
+{
+    int fl = class / SL_COUNT;
+    unsigned int map;
+
+    if (fl >= FL_COUNT)
+        return -1;
+    map = a->slBitmap[fl] & (~0U << (class % SL_COUNT));
+    if (map == 0) {
+        map = a->flBitmap & (~0U << (fl + 1));
+        if (map == 0)
+            return -1;
+        fl = __builtin_ctz(map);
+        map = a->slBitmap[fl];
+    }
+    return fl * SL_COUNT + __builtin_ctz(map);
+}
+/*
+ * Inserts the free block at the front of the freelist of its size class,
+ * or in address order with MM_ADDR_ORDER, or into the tree if it is large.
+ */ 
+static void insertFront(arena_t *a, void *bp) 
+{
+    int class;
+    unsigned int *head;
+    char *prev = NULL, *next;
+
+    if (GET_SIZE(HDRP(bp)) >= TREE_MIN) {
+        treeInsert(a, bp);
+        return;
+    }
+    class = sizeClass(GET_SIZE(HDRP(bp)));
+    head = &a->freeLists[class];
+
+    if ((policy & MM_ADDR_ORDER) && *head != 0) {
+        /* go past the blocks below bp and link it in after the last of them */
+        for (next = GET_LINK(head); next != NULL && next < (char *)bp; next = NEXT_OF(next))
+            prev = next;
+        if (prev != NULL) {
+            PUT_LINK(NEXT_LINK(bp), next);
+            PUT_LINK(PREV_LINK(bp), prev);
+            PUT_LINK(NEXT_LINK(prev), bp);
+            if (next != NULL)
+                PUT_LINK(PREV_LINK(next), bp);
+            return;
+        }
+    }
+    if (*head != 0) {
+        PUT(NEXT_LINK(bp), *head);
+        PUT_LINK(PREV_LINK(GET_LINK(head)), bp);
+    } else {
+        PUT(NEXT_LINK(bp), 0);
+        a->flBitmap |= 1U << (class / SL_COUNT);
+        a->slBitmap[class / SL_COUNT] |= 1U << (class % SL_COUNT);
+    }
+    PUT(PREV_LINK(bp), 0);
+    PUT_LINK(head, bp);
+}
+/*
+ * Removes the block from the freelist of its size class, or from the tree.
+ */
+static void removeFree(arena_t *a, void *wp) 
+{
+    int class;
+    unsigned int *head;
+    char *lo;
+
+    if (GET_DECOMMITTED(HDRP(wp)))
+        a->decommitted -= interior(wp, &lo);
+    if (GET_SIZE(HDRP(wp)) >= TREE_MIN) {
+        treeRemove(a, wp);
+        return;
+    }
+    if (GET_LINK(&a->rover) == wp)
+        a->rover = GET(NEXT_LINK(wp));
+    class = sizeClass(GET_SIZE(HDRP(wp)));
+    head = &a->freeLists[class];
+
+    if (PREV_OF(wp) == NULL)
+        *head = GET(NEXT_LINK(wp));
+    else
+        PUT_LINK(NEXT_LINK(PREV_OF(wp)), NEXT_OF(wp));
+    if (NEXT_OF(wp) != NULL)
+        PUT_LINK(PREV_LINK(NEXT_OF(wp)), PREV_OF(wp));
+
+    if (*head == 0) {
+        a->slBitmap[class / SL_COUNT] &= ~(1U << (class % SL_COUNT));
+        if (a->slBitmap[class / SL_COUNT] == 0)
+            a->flBitmap &= ~(1U << (class / SL_COUNT));
+    }
+}
+/*
+ * Inserts the free block into the tree. We walk down while the nodes have
+ * higher priority than bp, then split the subtree below by bp's key into
+ * its left and right children.
+ */
+static void treeInsert(arena_t *a, void *bp)
+{
+    char *slot = (char *)&a->treeRoot, *cur, *left, *right;
+
+    while ((cur = GET_LINK(slot)) != NULL && PRIORITY(cur) >= PRIORITY(bp))
+        slot = TREE_LESS(bp, cur) ? LEFT_LINK(cur) : RIGHT_LINK(cur);
+
+    left = LEFT_LINK(bp);
+    right = RIGHT_LINK(bp);
+    while (cur != NULL) {
+        if (TREE_LESS(cur, bp)) {
+            PUT_LINK(left, cur);
+            left = RIGHT_LINK(cur);
+            cur = RIGHT_OF(cur);
+        } else {
+            PUT_LINK(right, cur);
+            right = LEFT_LINK(cur);
+            cur = LEFT_OF(cur);
+        }
+    }
+    PUT(left, 0);
+    PUT(right, 0);
+    PUT_LINK(slot, bp);
+}
+/*
+ * Removes the free block from the tree by merging its two subtrees
+ * into the slot that pointed to it.
+ */
+static void treeRemove(arena_t *a, void *bp)
+{
+    char *slot = (char *)&a->treeRoot, *cur, *left, *right;
+
+    while ((cur = GET_LINK(slot)) != bp)
+        slot = TREE_LESS(bp, cur) ? LEFT_LINK(cur) : RIGHT_LINK(cur);
+
+    left = LEFT_OF(bp);
+    right = RIGHT_OF(bp);
+    while (left != NULL && right != NULL) {
+        if (PRIORITY(left) > PRIORITY(right)) {
+            PUT_LINK(slot, left);
+            slot = RIGHT_LINK(left);
+            left = RIGHT_OF(left);
+        } else {
+            PUT_LINK(slot, right);
+            slot = LEFT_LINK(right);
+            right = LEFT_OF(right);
+        }
+    }
+    PUT_LINK(slot, left != NULL ? left : right);
+}
+/*
+ * Best fit from the tree: the smallest free block of at least asize bytes.
+ */
+static void *treeFit(arena_t *a, size_t asize)
+{
+    char *cur = GET_LINK(&a->treeRoot), *best = NULL;
+
+    while (cur != NULL) {
+        if (GET_SIZE(HDRP(cur)) >= asize) {
+            best = cur;
+            if (GET_SIZE(HDRP(cur)) == asize)
+                break;
+            cur = LEFT_OF(cur);
+        } else
+            cur = RIGHT_OF(cur);
+    }
+    return best;
+}
+/*
+ * Find a fit for a block with asize bytes. With MM_FIT_GOOD the best of the
+ * first FIT_SCAN blocks in the request's own class is used if any of them
+ * fit, otherwise the head of the first non-empty class above it, whose
+ * blocks all fit. Either way the cost does not depend on how many free
+ * blocks there are. MM_FIT_BEST looks at all of both classes, MM_FIT_FIRST
+ * takes the first block of the class that fits and MM_FIT_NEXT the first
+ * after the one it took last. Large requests, and small ones no class can
+ * serve, get the best fit from the tree.
+ */
+static void *find_fit(arena_t *a, size_t asize) 
+{
+    int fit = policy & MM_FIT_MASK, class;
+    char *bp;
+
+    if (asize >= TREE_MIN)
+        return treeFit(a, asize);
+
+    class = sizeClass(asize);
+    if (fit == MM_FIT_NEXT)
+        bp = nextFit(a, class, asize);
+    else
+        bp = classFit(GET_LINK(&a->freeLists[class]), asize, fit == MM_FIT_GOOD ? FIT_SCAN : INT_MAX,
+                      fit == MM_FIT_FIRST);
+    if (bp != NULL)
+        return bp;
+
+    if ((class = nextClass(a, class + 1)) < 0)
+        return treeFit(a, asize);
+    if (fit == MM_FIT_BEST)
+        return classFit(GET_LINK(&a->freeLists[class]), asize, INT_MAX, 0);
+    return GET_LINK(&a->freeLists[class]);
+}
+/*
+ * Returns the smallest of the first scan blocks of a free list from bp on
+ * that can hold asize bytes, or the first of them if first is set. NULL if
+ * none can.
+ */
+static void *classFit(char *bp, size_t asize, int scan, int first)
+{
+    char *best = NULL;
+    int n;
+
+    for (n = 0; bp != NULL && n < scan; bp = NEXT_OF(bp), n++) {
+        if (asize <= GET_SIZE(HDRP(bp))) {
+            if (best == NULL || GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(best)))
+                best = bp;
+            if (first || GET_SIZE(HDRP(bp)) == asize)
+                break;
+        }
+    }
+    return best;
+}
+/*
+ * Next fit in the free list of class: the first block that can hold asize
+ * bytes from the arena's rover on, wrapping around to the head. The rover
+ * stays on the list when removeFree takes the block off it.
+ */
+static void *nextFit(arena_t *a, int class, size_t asize)
+{
+    char *head = GET_LINK(&a->freeLists[class]), *start = GET_LINK(&a->rover), *bp;
+
+    if (start == NULL || sizeClass(GET_SIZE(HDRP(start))) != class)
+        start = head;
+    for (bp = start; bp != NULL && GET_SIZE(HDRP(bp)) < asize; bp = NEXT_OF(bp))
+        ;
+    if (bp == NULL && start != head) {
+        for (bp = head; bp != start && GET_SIZE(HDRP(bp)) < asize; bp = NEXT_OF(bp))
+            ;
+        if (bp == start)
+            bp = NULL;
+    }
+    if (bp != NULL)
+        PUT_LINK(&a->rover, bp);
+    return bp;
+}
+/*
+ * Place a block of asize bytes in the free block bp that find_fit returned,
+ * and return where it starts. That is the front of bp as with place, but
+ * with MM_SPLIT_END a small block goes at the end, so the free space in
+ * front stays in one piece with the blocks before it and small blocks
+ * gather apart from large ones.
+ */
+static void *placeFit(arena_t *a, void *bp, size_t asize)
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+
+    /* the interior of a d block would have to be counted again, leave it to place */
+    if (!(policy & MM_SPLIT_END) || asize >= SPLIT_SMALL || csize - asize < OVERHEAD ||
+        GET_DECOMMITTED(HDRP(bp))) {
+        place(a, bp, asize);
+        return bp;
+    }
+    removeFree(a, bp);
+    PUT(HDRP(bp), PACK(csize - asize, GET_PREV_ALLOC(HDRP(bp))));
+    PUT(FTRP(bp), PACK(csize - asize, 0));
+    insertFront(a, bp);
+    bp = NEXT_BLKP(bp);
+    PUT(HDRP(bp), PACK(asize, 1));
+    SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    return bp;
+}
+/*
+ * Place block of asize bytes at start of free block bp 
+ * and split if remainder would be at least minimum block size.
+ * Also takes allocated blocks, which are shrunk the same way.
+ */
+static void place(arena_t *a, void *bp, size_t asize) 
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    size_t decommitted = !GET_ALLOC(HDRP(bp)) && GET_DECOMMITTED(HDRP(bp));
+    char *lo;
+    /* remove bp from the freelist */
+    if (!GET_ALLOC(HDRP(bp)))
+        removeFree(a, bp);
+
+    if ((csize - asize) >= (OVERHEAD)) { 
+        /* splitting them */
+        PUT(HDRP(bp), PACK(asize, prev_alloc | 1));
+        bp = NEXT_BLKP(bp);
+        PUT(HDRP(bp), PACK(csize-asize, PREV_ALLOC));
+        PUT(FTRP(bp), PACK(csize-asize, 0));
+        CLR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+        /* the remainder's interior is still decommitted */
+        if (decommitted && interior(bp, &lo) != 0) {
+            PUT(HDRP(bp), GET(HDRP(bp)) | DECOMMITTED);
+            a->decommitted += interior(bp, &lo);
+        }
+        
+        /* insert bp into freelist */
+        insertFront(a, bp);
+    }
+    else { 
+        /* not splitting, remainder too small */
+        PUT(HDRP(bp), PACK(csize, prev_alloc | 1));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    }
+}
+/*
+ * Check the heap for consistency 
+ */
+void mm_checkheap(int verbose) 
+{
+    char *bp, *lo, *end, *brk = (char *)mem_heap_hi() + 1;
+    arena_t *a;
+    int class;
+    size_t decommitted[ALL_ARENAS] = {0};
+
+    /* walk the segments in address order, each starts at a chunk boundary */
+    for (bp = heapBegin; bp < brk; bp = heapLo + CHUNK_UP(end) + DSIZE) {
+        a = ARENA_OF(bp);
+        /* the padding of an mm_create heap's segment holds where its region ends */
+        end = GET_LINK(bp - DSIZE);
+        /* print heap */
+        if (verbose)
+            printf("Heap (%p) of arena %d:\n", bp, (int)(a - arenas));
+
+        if ((GET_SIZE(HDRP(bp)) != DSIZE) || !GET_ALLOC(HDRP(bp)))
+            printf("Bad prologue header\n");
+        checkblock(bp);
+
+        for (; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+            if (verbose) 
+                printblock(bp);
+            if (!GET_ALLOC(HDRP(bp)) && !GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
+                printf("Error: Heap contains contiguous free blocks that somehow escaped coalescing!\n");
+                exit(1);
+            }
+            if (!GET_ALLOC(HDRP(bp)) != !GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)))) {
+                printf("Error: pa/pf bit of %p does not match the block before it!\n", NEXT_BLKP(bp));
+                exit(1);
+            }
+            if (ARENA_OF(bp) != a) {
+                printf("Error: Block %p is mapped to another arena than its segment!\n", bp);
+                exit(1);
+            }
+            if (!GET_ALLOC(HDRP(bp))) {
+                if (!contains(bp)) {
+                    printf("Error: There exists a free block which is NOT in the freelist!\n");
+                    exit(1);
+                }
+                if (GET_DECOMMITTED(HDRP(bp)))
+                    decommitted[a - arenas] += interior(bp, &lo);
+            }
+#if MM_SLABS
+            if (IS_SLAB(bp)) {
+                if ((char *)SLAB_OF(bp) != bp || !GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) != SLAB_SIZE) {
+                    printf("Error: Block %p lies in a slab page but is not a slab!\n", bp);
+                    exit(1);
+                }
+                checkslab((slab_t *)bp);
+            }
+#endif
+            checkblock(bp);
+        }
+     
+        if (verbose)
+            printblock(bp);
+        /* the segment at the brk is the last one of its arena */
+        if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))) || (bp == brk && bp != GET_LINK(&a->heapEnd)))
+            printf("Bad epilogue header\n");
+        if (end == NULL)
+            end = bp;
+    }
+
+    for (a = arenas; a < arenas + ALL_ARENAS; a++) {
+        if (a->decommitted != decommitted[a - arenas]) {
+            printf("Error: Arena %d counts %lu decommitted bytes but its blocks have %lu!\n",
+                   (int)(a - arenas), (unsigned long)a->decommitted, (unsigned long)decommitted[a - arenas]);
+            exit(1);
+        }
+        /* print freelists */
+        for (class = 0; class < NUM_CLASSES; class++) {
+            /* Do the bitmaps agree with the lists? */
+            if ((a->freeLists[class] != 0) != ((a->slBitmap[class / SL_COUNT] >> (class % SL_COUNT)) & 1) ||
+                (a->slBitmap[class / SL_COUNT] != 0) != ((a->flBitmap >> (class / SL_COUNT)) & 1)) {
+                printf("Error: Bitmaps out of sync with free class %d!\n", class);
+                exit(1);
+            }
+            if (a->freeLists[class] == 0 || !verbose)
+                continue;
+            printf("Free class %d (%p):\n", class, GET_LINK(&a->freeLists[class]));
+            for (bp = GET_LINK(&a->freeLists[class]); bp != NULL; bp = NEXT_OF(bp)) {
+                /* Is every block in the free list marked as free? */
+                if (GET_ALLOC(HDRP(bp))) {
+                    printf("Error: Allocated block in freelist!\n");
+                    exit(1);
+                }
+                /* Is every block in the free list of the right size class and arena? */
+                if (sizeClass(GET_SIZE(HDRP(bp))) != class || ARENA_OF(bp) != a) {
+                    printf("Error: Block of size %u in free class %d!\n", (unsigned)GET_SIZE(HDRP(bp)), class);
+                    exit(1);
+                }
+                if ((NEXT_OF(bp) != NULL && !contains(NEXT_OF(bp))) || (PREV_OF(bp) != NULL && !contains(PREV_OF(bp)))) {
+                    printf("Error: A link in a free block does not point to a valid free block!");
+                    exit(1);
+                }
+                printblock(bp);
+            }
+        }
+
+#if MM_SLABS
+        /* Are the slabs on the lists of their size and not full? */
+        for (class = 0; class < SLAB_CLASSES; class++) {
+            slab_t *sp, *prev = NULL;
+            for (sp = (slab_t *)GET_LINK(&a->slabs[class]); sp != NULL; prev = sp, sp = (slab_t *)GET_LINK(&sp->next)) {
+                if (!IS_SLAB(sp) || sp->size != class * ALIGNMENT || sp->free == 0 ||
+                    (slab_t *)GET_LINK(&sp->prev) != prev || ARENA_OF(sp) != a) {
+                    printf("Error: Slab %p is on the wrong list!\n", sp);
+                    exit(1);
+                }
+            }
+        }
+#endif
+
+#if MM_QUICK
+        /* Are the blocks on the quick lists allocated, of their list's size and counted? */
+        size_t quick = 0;
+        for (class = 0; class < QUICK_BINS; class++) {
+            for (bp = GET_LINK(&a->quick[class]); bp != NULL; bp = NEXT_OF(bp)) {
+                quick += GET_SIZE(HDRP(bp));
+                if (!GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) != class * ALIGNMENT || ARENA_OF(bp) != a) {
+                    printf("Error: Block %p is on the wrong quick list!\n", bp);
+                    exit(1);
+                }
+            }
+        }
+        if (quick != a->quickBytes || quick > QUICK_BYTES) {
+            printf("Error: Arena %d counts %u bytes on its quick lists but they have %lu!\n",
+                   (int)(a - arenas), a->quickBytes, (unsigned long)quick);
+            exit(1);
+        }
+#endif
+
+        /* check and print the tree of large free blocks */
+        if (verbose && a->treeRoot != 0)
+            printf("Free tree (%p):\n", GET_LINK(&a->treeRoot));
+        checktree(GET_LINK(&a->treeRoot), NULL, NULL);
+    }
+}
+/*
+ * Check the subtree rooted at bp: every node is a large free block between
+ * lo and hi in tree order with no more priority than its parent. Returns
+ * the number of nodes.
+ */
+static size_t checktree(void *bp, void *lo, void *hi)
+{
+    if (bp == NULL)
+        return 0;
+    if (GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < TREE_MIN) {
+        printf("Error: Block %p in the free tree is allocated or too small!\n", bp);
+        exit(1);
+    }
+    if ((lo != NULL && !TREE_LESS(lo, bp)) || (hi != NULL && !TREE_LESS(bp, hi))) {
+        printf("Error: Free tree out of order at %p!\n", bp);
+        exit(1);
+    }
+    if ((LEFT_OF(bp) != NULL && PRIORITY(LEFT_OF(bp)) > PRIORITY(bp)) ||
+        (RIGHT_OF(bp) != NULL && PRIORITY(RIGHT_OF(bp)) > PRIORITY(bp))) {
+        printf("Error: Free tree priorities out of order at %p!\n", bp);
+        exit(1);
+    }
+    if (verbose)
+        printblock(bp);
+    return 1 + checktree(LEFT_OF(bp), lo, bp) + checktree(RIGHT_OF(bp), bp, hi);
+}
+#if MM_SLABS
+/*
+ * Check that the slab's bitmap agrees with its count of free objects
+ */
+static void checkslab(slab_t *s)
+{
+    int i, used = 0;
+
+    if (s->size == 0 || s->size > SLAB_MAX || s->size % ALIGNMENT || s->count != SLAB_OBJS / s->size) {
+        printf("Error: Slab %p has a bad object size %d!\n", s, s->size);
+        exit(1);
+    }
+    for (i = 0; i < SLAB_WORDS * 64; i++) {
+        if (((s->used[i / 64] >> (i % 64)) & 1) && i < s->count)
+            used++;
+        else if (i >= s->count && !((s->used[i / 64] >> (i % 64)) & 1)) {
+            printf("Error: Slab %p has a free object past its end!\n", s);
+            exit(1);
+        }
+    }
+    if (used + s->free != s->count) {
+        printf("Error: Slab %p has %d objects in use but %d free of %d!\n", s, used, s->free, s->count);
+        exit(1);
+    }
+    if (verbose)
+        printf("%p: slab of %d objects of %d bytes, %d free\n", s, s->count, s->size, s->free);
+}
+#endif
+/*
+ * Print block
+ */
+static void printblock(void *bp) 
+{
+    size_t hsize, halloc, hprev, fsize, falloc;
+
+    hsize = GET_SIZE(HDRP(bp));
+    halloc = GET_ALLOC(HDRP(bp));
+    hprev = GET_PREV_ALLOC(HDRP(bp));
+    
+    if (hsize == 0) {
+        printf("%p: EOL\n", bp);
+        return;
+    }
+    if (halloc) {
+        printf("%p: header: [%d:%c:%c]\n", bp,
+               (int)hsize, (hprev ? 'a' : 'f'), 'a');
+        return;
+    }
+
+    fsize = GET_SIZE(FTRP(bp));
+    falloc = GET_ALLOC(FTRP(bp));
+    printf("%p: header: [%d:%c:%c%s] footer: [%d:%c]\n", bp, 
+           (int)hsize, (hprev ? 'a' : 'f'), 'f', (GET_DECOMMITTED(HDRP(bp)) ? ":d" : ""),
+           (int)fsize, (falloc ? 'a' : 'f')); 
+}
+/*
+ * Check if block is obeying the rules
+ */
+static void checkblock(void *bp) 
+{
+    if ((size_t)bp % 8) {
+        printf("Error: %p is not doubleword aligned\n", bp);
+        exit(1);
+    }
+    if (!GET_ALLOC(HDRP(bp)) && GET_SIZE(HDRP(bp)) != GET(FTRP(bp))) {
+        printf("Error: header does not match footer\n");
+        exit(1);
+    }
+}
+
+/*
+ * Check if free block bp is in the freelist of its size class, or in the tree
+ */
+size_t contains(void *bp)
+{
+    void *curr;
+
+    if (GET_SIZE(HDRP(bp)) >= TREE_MIN) {
+        for (curr = GET_LINK(&ARENA_OF(bp)->treeRoot); curr != NULL && curr != bp; )
+            curr = TREE_LESS(bp, curr) ? LEFT_OF(curr) : RIGHT_OF(curr);
+        return curr != NULL;
+    }
+    for (curr = GET_LINK(&ARENA_OF(bp)->freeLists[sizeClass(GET_SIZE(HDRP(bp)))]); curr != NULL; curr = NEXT_OF(curr)) {
+        if (curr == bp)
+            return 1;
     }
     return 0;
 }
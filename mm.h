@@ -4,6 +4,41 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern size_t mm_reserved(void);
+extern size_t mm_committed(void);
+/* Placement policies for mm_policy, one MM_FIT_* or'ed with the flags */
+#define MM_FIT_GOOD   0     /* best of the first few blocks of the size class, the default */
+#define MM_FIT_FIRST  1     /* first block of the size class that fits */
+#define MM_FIT_NEXT   2     /* first that fits after the last one taken */
+#define MM_FIT_BEST   3     /* smallest block that fits */
+#define MM_FIT_MASK   3
+#define MM_ADDR_ORDER 4     /* keep the free lists in address order instead of LIFO */
+#define MM_SPLIT_END  8     /* put small blocks at the end of the free block they split */
+#define MM_FREE_LISTS_ONLY 16 /* place small requests too, bypassing slabs, tcaches and quick lists */
+extern void mm_policy(int policy);
+/* A heap in a file, built with make SHARED=1, mm_open returns -1 in other builds */
+extern int mm_open(const char *path);
+extern void mm_close(void);
+extern void *mm_root(void);
+extern void mm_set_root(void *ptr);
+/* Heaps of their own, thrown away as a whole */
+typedef struct mm_heap mm_heap_t;
+extern mm_heap_t *mm_create(size_t max);
+extern void mm_destroy(mm_heap_t *h);
+extern void *mm_heap_malloc(mm_heap_t *h, size_t size);
+extern void mm_heap_free(mm_heap_t *h, void *ptr);
+/* Bump arenas for objects that are only ever freed all together */
+typedef struct mm_arena mm_arena_t;
+extern mm_arena_t *mm_arena_create(size_t chunk);
+extern void *mm_arena_alloc(mm_arena_t *r, size_t size);
+extern void mm_arena_reset(mm_arena_t *r);
+extern void mm_arena_destroy(mm_arena_t *r);
 
 
 /* 